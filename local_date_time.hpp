@@ -2,9 +2,70 @@
 #define LOCAL_DATE_TIME_LOCAL_DATE_TIME_HPP
 
 #include "timezone.hpp"
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <chrono>
+#include <type_traits>
 
 namespace local_time {  
 
+class local_date_time_result;
+
+namespace detail {
+
+//! Floor of a duration in a coarser unit; duration_cast truncates towards zero
+template<class To, class Rep, class Period>
+To floor_duration(const std::chrono::duration<Rep, Period>& d) {
+  To t = std::chrono::duration_cast<To>(d);
+  return t > d ? t - To(1) : t;
+}
+
+//! Time zone lookups on std::chrono durations since 1970-01-01: durations of a microsecond or finer
+//! are passed as they are, coarser ones are scaled to microseconds and the local times floored back
+template<class Duration, bool Fine = (Duration::period::num == 1 && Duration::period::den % 1000000 == 0)>
+struct chrono_lookup {
+  struct resolution { static const int64_t ticks_per_microsecond = Duration::period::den / 1000000; };
+
+  static Duration to_local(const time_zone& tz, const Duration& utc) {
+    return Duration(tz.to_local<resolution>(utc.count()));
+  }
+
+  static Duration to_utc(const time_zone& tz, const Duration& local, time_zone::automatic_conversion dst) {
+    return Duration(tz.to_utc<resolution>(local.count(), dst));
+  }
+
+  static const time_zone_entry_info* entry(const time_zone& tz, const Duration& utc) {
+    return tz.entry_from_utc<resolution>(utc.count());
+  }
+};
+
+template<class Duration>
+struct chrono_lookup<Duration, false> {
+  static Duration to_local(const time_zone& tz, const Duration& utc) {
+    return floor_duration<Duration>(std::chrono::microseconds(tz.to_local(std::chrono::duration_cast<std::chrono::microseconds>(utc).count())));
+  }
+
+  static Duration to_utc(const time_zone& tz, const Duration& local, time_zone::automatic_conversion dst) {
+    return floor_duration<Duration>(std::chrono::microseconds(tz.to_utc(std::chrono::duration_cast<std::chrono::microseconds>(local).count(), dst)));
+  }
+
+  static const time_zone_entry_info* entry(const time_zone& tz, const Duration& utc) {
+    return tz.entry_from_utc(std::chrono::duration_cast<std::chrono::microseconds>(utc).count());
+  }
+};
+
+//! Read n decimal digits into v, false if any is not a digit
+inline bool scan_digits(const char* p, std::size_t n, int64_t& v) {
+  v = 0;
+  for(std::size_t i=0; i<n; ++i, ++p) {
+    if(*p < '0' || *p > '9')
+      return false;
+    v = v * 10 + (*p - '0');
+  }
+  return true;
+}
+
+}
+
 class local_date_time { 
   
 public:
@@ -20,7 +81,72 @@ public:
   local_date_time(const local_date_time& other) : _utc(other._utc), _tz(other._tz) { }
 
   local_date_time(boost::posix_time::special_values sv, time_zone_const_ptr tz) : _utc(sv), _tz(tz) { }
-  
+
+  //! From a std::chrono UTC time, rounded down to microseconds
+  template<class Duration>
+  local_date_time(const std::chrono::time_point<std::chrono::system_clock, Duration>& utc, time_zone_const_ptr tz) 
+    : _utc(detail::microseconds_to_ptime(detail::floor_duration<std::chrono::microseconds>(utc.time_since_epoch()).count())), _tz(tz) { }
+
+  //! Non-throwing counterparts of the local time constructor
+  static local_date_time_result try_from_local(const ptime& local, time_zone_const_ptr tz, time_zone::automatic_conversion dst = time_zone::automatic_conversion::THROW_ON_AMBIGUOUS);
+
+  static local_date_time_result try_from_local(const boost::gregorian::date& d, const time_duration& td, time_zone_const_ptr tz, time_zone::automatic_conversion dst = time_zone::automatic_conversion::THROW_ON_AMBIGUOUS);
+  
+  //! Parse a time as written by to_string ("20150321T120000 EDT") or to_iso_string ("20150321T080000-0400", UTC having no
+  //! suffix), placed in the zone of db that time_zone_database::resolve_abbreviation or resolve_offset finds for it.
+  //! Throws std::runtime_error on a malformed string and time_label_invalid when no zone of db matches.
+  static local_date_time from_string(const std::string& s, const time_zone_database& db) {
+    const char* p = s.c_str();
+    const char* end = p + s.size();
+    int64_t ymd = 0, hms = 0;
+    if(s.size() < 15 || p[8] != 'T' || !detail::scan_digits(p, 8, ymd) || !detail::scan_digits(p + 9, 6, hms))
+      throw std::runtime_error("Invalid local time string '" + s + "'");
+    int64_t hours = hms / 10000, minutes = hms / 100 % 100, seconds = hms % 100;
+    if(hours > 23 || minutes > 59 || seconds > 59)
+      throw std::runtime_error("Invalid local time string '" + s + "'");
+    int64_t local;
+    try {
+      boost::gregorian::date d(static_cast<unsigned short>(ymd / 10000), static_cast<unsigned short>(ymd / 100 % 100), static_cast<unsigned short>(ymd % 100));
+      local = ((d - boost::gregorian::date(1970, 1, 1)).days() * INT64_C(86400) + hours * 3600 + minutes * 60 + seconds) * INT64_C(1000000);
+    }
+    catch(const std::out_of_range&) {
+      throw std::runtime_error("Invalid local time string '" + s + "'");
+    }
+    p += 15;
+    if(p != end && *p == '.') {
+      // fractional seconds, truncated to microseconds
+      int64_t scale = 100000;
+      const char* digits = ++p;
+      for(; p != end && *p >= '0' && *p <= '9'; ++p, scale /= 10)
+        local += (*p - '0') * scale;
+      if(p == digits)
+        throw std::runtime_error("Invalid local time string '" + s + "'");
+    }
+
+    time_zone_const_ptr tz;
+    int64_t utc = 0;
+    if(p != end && *p == ' ' && p + 1 != end)
+      tz = db.resolve_abbreviation(std::string(p + 1, end), local, utc);
+    else if(p == end || *p == '+' || *p == '-') {
+      // to_iso_string writes the offset from UTC, of the opposite sign of the offsets of the entries
+      int64_t offset = 0;
+      if(p != end) {
+        std::size_t n = end - p - 1;
+        if((n != 4 && n != 6) || !detail::scan_digits(p + 1, n, offset))
+          throw std::runtime_error("Invalid local time string '" + s + "'");
+        offset = n == 4 ? offset / 100 * 3600 + offset % 100 * 60 : offset / 10000 * 3600 + offset / 100 % 100 * 60 + offset % 100;
+        if(*p == '+')
+          offset = -offset;
+      }
+      tz = db.resolve_offset(static_cast<long>(offset), local, utc);
+    }
+    else
+      throw std::runtime_error("Invalid local time string '" + s + "'");
+    if(!tz)
+      throw time_label_invalid(p == end ? std::string("UTC") : std::string(p + (*p == ' '), end), std::string(s.c_str(), p));
+    return local_date_time(detail::microseconds_to_ptime(utc), tz);
+  }
+
   const time_zone_const_ptr zone() const { return _tz; }
   
   bool is_dst() {
@@ -126,12 +252,146 @@ public:
     else
       return boost::posix_time::to_iso_string(_utc);
   }
+
+  std::string to_iso_extended_string() const {
+    if(_tz)
+      return _tz->utc_to_local_iso_extended_string(_utc);
+    else
+      return boost::posix_time::to_iso_extended_string(_utc);
+  }
   
 private:
   ptime                 _utc;
   time_zone_const_ptr   _tz;
 };
 
+
+//! Outcome of local_date_time::try_from_local: a status code and, for ambiguous or invalid local times, both candidate instants
+class local_date_time_result {
+public:
+  local_time_status status() const { return _status; }
+
+  bool valid() const { return _status == LOCAL_TIME_VALID; }
+
+  explicit operator bool() const { return valid(); }
+
+  //! The converted time, not_a_date_time unless the conversion succeeded
+  local_date_time value() const { return local_date_time(valid() ? _earlier : ptime(boost::posix_time::not_a_date_time), _tz); }
+
+  //! Earlier of the two candidate instants, the converted time if valid
+  local_date_time earlier() const { return local_date_time(_earlier, _tz); }
+
+  //! Later of the two candidate instants, the converted time if valid
+  local_date_time later() const { return local_date_time(_later, _tz); }
+
+private:
+  local_time_status     _status;
+  ptime                 _earlier;
+  ptime                 _later;
+  time_zone_const_ptr   _tz;
+
+  local_date_time_result(local_time_status status, const ptime& earlier, const ptime& later, time_zone_const_ptr&& tz) : _status(status), _earlier(earlier), _later(later), _tz(std::move(tz)) { }
+
+  friend class local_date_time;
+};
+
+
+//! A std::chrono UTC time in a time zone. Lookups work on the durations themselves, so nanosecond
+//! time points keep their nanoseconds; local times are durations since 1970-01-01 00:00 local time.
+template<class Duration = std::chrono::system_clock::duration>
+class zoned_instant {
+  static_assert(std::is_integral<typename Duration::rep>::value, "zoned_instant needs an integral duration");
+  typedef detail::chrono_lookup<Duration> lookup;
+
+public:
+  typedef Duration                                                        duration;
+  typedef std::chrono::time_point<std::chrono::system_clock, Duration>    time_point;
+
+  zoned_instant(const time_point& utc, time_zone_const_ptr tz) : _utc(utc), _tz(std::move(tz)) { }
+
+  //! From a local_date_time, which has no std::chrono equivalent when it holds a special value
+  explicit zoned_instant(const local_date_time& ldt) : _tz(ldt.zone()) {
+    if(ldt.is_special())
+      throw local_time_exception("Special time values cannot be represented by std::chrono.");
+    _utc = time_point(detail::floor_duration<Duration>(std::chrono::microseconds(detail::ptime_to_microseconds(ldt.utc_time()))));
+  }
+
+  //! From a local time of the zone; throws like local_date_time on ambiguous or invalid times
+  static zoned_instant from_local(const Duration& local, time_zone_const_ptr tz, time_zone::automatic_conversion dst = time_zone::automatic_conversion::THROW_ON_AMBIGUOUS) {
+    time_point utc(tz ? lookup::to_utc(*tz, local, dst) : local);
+    return zoned_instant(utc, std::move(tz));
+  }
+
+  const time_zone_const_ptr zone() const { return _tz; }
+
+  time_point utc_time() const { return _utc; }
+
+  Duration local_time() const {
+    return _tz ? lookup::to_local(*_tz, _utc.time_since_epoch()) : _utc.time_since_epoch();
+  }
+
+  bool is_dst() const {
+    const time_zone_entry_info* z = _tz ? lookup::entry(*_tz, _utc.time_since_epoch()) : nullptr;
+    return z && z->dst;
+  }
+
+  //! Time zone abbreviation in effect, empty without a zone
+  std::string abbreviation() const {
+    const time_zone_entry_info* z = _tz ? lookup::entry(*_tz, _utc.time_since_epoch()) : nullptr;
+    return z ? z->tz : std::string();
+  }
+
+  //! The same instant as a local_date_time, rounded down to microseconds
+  local_date_time to_local_date_time() const { return local_date_time(_utc, _tz); }
+
+  //! The same instant in another zone
+  zoned_instant in(time_zone_const_ptr tz) const { return zoned_instant(_utc, std::move(tz)); }
+
+  bool operator== (const zoned_instant& rhs) const { return _utc == rhs._utc; }
+
+  bool operator!= (const zoned_instant& rhs) const { return _utc != rhs._utc; }
+
+  bool operator< (const zoned_instant& rhs) const { return _utc < rhs._utc; }
+
+  bool operator> (const zoned_instant& rhs) const { return _utc > rhs._utc; }
+
+  bool operator<= (const zoned_instant& rhs) const { return _utc <= rhs._utc; }
+
+  bool operator>= (const zoned_instant& rhs) const { return _utc >= rhs._utc; }
+
+  zoned_instant operator+ (const Duration& d) const { return zoned_instant(_utc + d, _tz); }
+
+  zoned_instant& operator+= (const Duration& d) { _utc += d; return *this; }
+
+  zoned_instant operator- (const Duration& d) const { return zoned_instant(_utc - d, _tz); }
+
+  zoned_instant& operator-= (const Duration& d) { _utc -= d; return *this; }
+
+  Duration operator- (const zoned_instant& rhs) const { return _utc - rhs._utc; }
+
+private:
+  time_point            _utc;
+  time_zone_const_ptr   _tz;
+};
+
+
+inline local_date_time_result local_date_time::try_from_local(const ptime& local, time_zone_const_ptr tz, time_zone::automatic_conversion dst) {
+  if(!tz)
+    return local_date_time_result(LOCAL_TIME_VALID, local, local, std::move(tz));
+  local_time_lookup r = tz->lookup_local(local, dst);
+  if(!r.first)
+    return local_date_time_result(LOCAL_TIME_VALID, local, local, std::move(tz));
+  ptime a = local + r.first->offset;
+  if(r.status == LOCAL_TIME_VALID)
+    return local_date_time_result(LOCAL_TIME_VALID, a, a, std::move(tz));
+  ptime b = local + r.second->offset;
+  return local_date_time_result(r.status, std::min(a, b), std::max(a, b), std::move(tz));
+}
+
+inline local_date_time_result local_date_time::try_from_local(const boost::gregorian::date& d, const time_duration& td, time_zone_const_ptr tz, time_zone::automatic_conversion dst) {
+  return try_from_local(ptime(d, td), std::move(tz), dst);
+}
+
 }
 
 #endif
@@ -3,6 +3,7 @@
 #include <boost/test/unit_test.hpp>
 
 #include "local_date_time.hpp"
+#include "timezone_loaders.hpp"
 #include <iostream>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -928,6 +929,1144 @@ BOOST_AUTO_TEST_CASE(test_local_date_time_zoneinfo) {
 }
 
 
+BOOST_AUTO_TEST_CASE(test_local_date_time_try_from_local) {
+  time_zone_database tzdb( time_zone_database::from_struct(zones_struct_simple) );
+  time_zone_const_ptr tz1 = tzdb.time_zone_from_region("TZ_1");
+  time_zone_const_ptr tz2 = tzdb.time_zone_from_region("TZ_2");
+  time_zone_const_ptr tz4 = tzdb.time_zone_from_region("TZ_4");
+  auto d1 = boost::gregorian::date(1970, 1, 1);
+  auto d2 = boost::gregorian::date(1970, 1, 2);
+
+  { // regular time
+    local_date_time_result r = local_date_time::try_from_local(d1, time_duration(5,0,0), tz1);
+    BOOST_CHECK(r);
+    BOOST_CHECK_EQUAL(r.status(), LOCAL_TIME_VALID);
+    BOOST_CHECK_EQUAL(r.value(), local_date_time(d1, time_duration(5,0,0), tz1));
+    BOOST_CHECK_EQUAL(r.value().zone(), tz1);
+    BOOST_CHECK_EQUAL(r.earlier(), r.later());
+  }
+  { // ambiguous
+    local_date_time_result r = local_date_time::try_from_local(d1, time_duration(23,30,0), tz1);
+    BOOST_CHECK(!r);
+    BOOST_CHECK_EQUAL(r.status(), LOCAL_TIME_AMBIGUOUS);
+    BOOST_CHECK(r.value().is_not_a_date_time());
+    BOOST_CHECK_EQUAL(r.earlier().utc_time(), ptime(d1, time_duration(23,30,0)));
+    BOOST_CHECK_EQUAL(r.later().utc_time(), ptime(d2, time_duration(0,30,0)));
+
+    // resolved by the conversion policy
+    r = local_date_time::try_from_local(ptime(d1, time_duration(23,30,0)), tz1, time_zone::ASSUME_DST);
+    BOOST_CHECK(r.valid());
+    BOOST_CHECK_EQUAL(r.value().utc_time(), ptime(d2, time_duration(0,30,0)));
+
+    // both segments have the same dst flag
+    r = local_date_time::try_from_local(d1, time_duration(23,30,0), tz4, time_zone::ASSUME_DST);
+    BOOST_CHECK_EQUAL(r.status(), LOCAL_TIME_AMBIGUOUS);
+  }
+  { // invalid
+    local_date_time_result r = local_date_time::try_from_local(d2, time_duration(0,30,0), tz2);
+    BOOST_CHECK_EQUAL(r.status(), LOCAL_TIME_INVALID);
+    BOOST_CHECK_EQUAL(r.earlier().utc_time(), ptime(d1, time_duration(23,30,0)));
+    BOOST_CHECK_EQUAL(r.later().utc_time(), ptime(d2, time_duration(0,30,0)));
+  }
+  { // no time zone
+    local_date_time_result r = local_date_time::try_from_local(d1, time_duration(5,0,0), time_zone_const_ptr());
+    BOOST_CHECK(r);
+    BOOST_CHECK_EQUAL(r.value().utc_time(), ptime(d1, time_duration(5,0,0)));
+    r = local_date_time::try_from_local(d1, time_duration(5,0,0), time_zone_const_ptr(new time_zone("empty")));
+    BOOST_CHECK_EQUAL(r.value().utc_time(), ptime(d1, time_duration(5,0,0)));
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_segment_index) {
+  time_zone_const_ptr tz(new time_zone(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo")));
+
+  // both sides of the indexed range
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(1960, 7, 1)), tz).to_iso_string(), "19600630T200000-0400");
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(1960, 1, 1)), tz).to_iso_string(), "19591231T190000-0500");
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(2015, 3, 8), time_duration(6,59,59)), tz).to_iso_string(), "20150308T015959-0500");
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(2015, 3, 8), time_duration(7,0,0)), tz).to_iso_string(), "20150308T030000-0400");
+  BOOST_CHECK_EQUAL(local_date_time(boost::gregorian::date(2015, 11, 1), time_duration(1,30,0), tz, time_zone::ASSUME_DST).utc_time(), ptime(boost::gregorian::date(2015, 11, 1), time_duration(5,30,0)));
+  BOOST_CHECK_EQUAL(local_date_time(boost::gregorian::date(2015, 11, 1), time_duration(1,30,0), tz, time_zone::ASSUME_NON_DST).utc_time(), ptime(boost::gregorian::date(2015, 11, 1), time_duration(6,30,0)));
+
+  // every utc time must be one of the candidates of its own local time
+  ptime p(boost::gregorian::date(1900, 1, 1), time_duration(0,17,0));
+  ptime end(boost::gregorian::date(2200, 1, 1));
+  std::size_t ambiguous = 0;
+  for(; p < end; p += time_duration(97,13,0)) {
+    local_date_time ldt(p, tz);
+    local_date_time_result r = local_date_time::try_from_local(ldt.local_time(), tz);
+    BOOST_REQUIRE(r.status() != LOCAL_TIME_INVALID);
+    BOOST_REQUIRE(r.earlier().utc_time() == p || r.later().utc_time() == p);
+    ambiguous += r.status() == LOCAL_TIME_AMBIGUOUS;
+  }
+  BOOST_CHECK(ambiguous > 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_fixed_offset_zones) {
+  ptime p(boost::gregorian::date(2015, 3, 21), time_duration(12,0,0));
+
+  time_zone_const_ptr utc(new time_zone(time_zone::from_zoneinfo("UTC", "/usr/share/zoneinfo")));
+  BOOST_CHECK_EQUAL(utc->kind(), time_zone::FIXED_OFFSET_ZONE);
+  BOOST_CHECK_EQUAL(local_date_time(p, utc).to_string(), "20150321T120000 UTC");
+
+  time_zone_const_ptr gmt5(new time_zone(time_zone::from_zoneinfo("Etc/GMT+5", "/usr/share/zoneinfo")));
+  BOOST_CHECK_EQUAL(gmt5->kind(), time_zone::FIXED_OFFSET_ZONE);
+  BOOST_CHECK_EQUAL(local_date_time(p, gmt5).to_iso_string(), "20150321T070000-0500");
+  BOOST_CHECK_EQUAL(local_date_time(p.date(), p.time_of_day(), gmt5).utc_time(), p + boost::posix_time::hours(5));
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(1800, 1, 1)), gmt5).to_iso_string(), "17991231T190000-0500");
+
+  // a single offset since 1945
+  time_zone_const_ptr kolkata(new time_zone(time_zone::from_zoneinfo("Asia/Kolkata", "/usr/share/zoneinfo")));
+  BOOST_CHECK_EQUAL(kolkata->kind(), time_zone::VARIABLE_OFFSET_ZONE);
+  BOOST_CHECK_EQUAL(local_date_time(p, kolkata).to_iso_string(), "20150321T173000+0530");
+  BOOST_CHECK_EQUAL(local_date_time(p.date(), p.time_of_day(), kolkata).utc_time(), p - time_duration(5,30,0));
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(1943, 1, 1)), kolkata).to_iso_string(), "19430101T063000+0630");
+
+  time_zone_ptr tz(new time_zone("A"));
+  BOOST_CHECK_EQUAL(tz->kind(), time_zone::EMPTY_ZONE);
+  tz->add_entry(0, time_zone_entry_info(3600, "ABC", false));
+  tz->add_entry(3600LL*24*1000000, time_zone_entry_info(3600, "ABC", false));
+  BOOST_CHECK_EQUAL(tz->kind(), time_zone::FIXED_OFFSET_ZONE);
+  BOOST_CHECK_EQUAL(local_date_time(p, tz).to_iso_string(), "20150321T110000-0100");
+  tz->add_entry(3600LL*48*1000000, time_zone_entry_info(3600, "DEF", false));
+  BOOST_CHECK_EQUAL(tz->kind(), time_zone::VARIABLE_OFFSET_ZONE);
+  BOOST_CHECK_EQUAL(local_date_time(p, tz).to_string(), "20150321T110000 DEF");
+}
+
+
+BOOST_AUTO_TEST_CASE(test_database_update) {
+  typedef std::tuple<int64_t, long, std::string, bool> entry;
+  const int64_t day = 3600LL*24*1000000;
+  std::map<std::string, std::vector<entry> > zones(zones_struct_simple);
+  time_zone_database old_db( time_zone_database::from_struct(zones) );
+
+  zones.erase("TZ_6");
+  zones["TZ_2"].push_back(entry(2 * day, 0, "EST", 0));
+  zones["TZ_3"][1] = entry(day, 7200, "EST", 0);
+  zones["TZ_7"] = { entry(0, -7200, "ABC", 0) };
+  time_zone_database new_db( time_zone_database::from_struct(zones) );
+
+  time_zone_update update = time_zone_database::diff(old_db, new_db);
+  BOOST_REQUIRE_EQUAL(update.changes.size(), 4u);
+  BOOST_CHECK_EQUAL(update.changes[0].name, "TZ_2");
+  BOOST_CHECK_EQUAL(update.changes[0].from, 2 * day);
+  BOOST_CHECK_EQUAL(update.changes[0].to, 2 * day);
+  BOOST_CHECK_EQUAL(update.changes[0].entries.size(), 1u);
+  BOOST_CHECK_EQUAL(update.changes[1].name, "TZ_3");
+  BOOST_CHECK_EQUAL(update.changes[1].from, day);
+  BOOST_CHECK_EQUAL(update.changes[2].name, "TZ_6");
+  BOOST_CHECK(update.changes[2].remove);
+  BOOST_CHECK_EQUAL(update.changes[3].name, "TZ_7");
+
+  // round trip through a file
+  boost::filesystem::path path;
+  while( path.empty() || boost::filesystem::exists(path) ) {
+    path = boost::filesystem::temp_directory_path();
+    path /= boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%");
+  }
+  BOOST_CHECK(update.save_to_file(path.string()));
+  update = time_zone_update::from_file(path.string());
+  boost::filesystem::remove(path);
+  BOOST_REQUIRE_EQUAL(update.changes.size(), 4u);
+
+  time_zone_const_ptr tz1 = old_db.time_zone_from_region("TZ_1");
+  time_zone_const_ptr tz2 = old_db.time_zone_from_region("TZ_2");
+  BOOST_CHECK(old_db.apply_update(update));
+
+  // untouched zones stay shared, changed ones are replaced
+  BOOST_CHECK_EQUAL(old_db.time_zone_from_region("TZ_1"), tz1);
+  BOOST_CHECK(old_db.time_zone_from_region("TZ_2") != tz2);
+  BOOST_CHECK(!old_db.time_zone_from_region("TZ_6"));
+  BOOST_CHECK(time_zone_database::diff(old_db, new_db).changes.empty());
+
+  ptime p(boost::gregorian::date(2000, 1, 1));
+  BOOST_CHECK_EQUAL(local_date_time(p, old_db.time_zone_from_region("TZ_2")).to_string(), "20000101T000000 EST");
+  BOOST_CHECK_EQUAL(local_date_time(p, old_db.time_zone_from_region("TZ_3")).to_string(), "19991231T220000 EST");
+  BOOST_CHECK_EQUAL(local_date_time(p, old_db.time_zone_from_region("TZ_7")).to_string(), "20000101T020000 ABC");
+  // the old version of a zone is still usable
+  BOOST_CHECK_EQUAL(local_date_time(p, tz2).to_string(), "20000101T010000 DST");
+}
+
+
+BOOST_AUTO_TEST_CASE(test_parallel_file_load) {
+  boost::filesystem::path path;
+  while( path.empty() || boost::filesystem::exists(path) ) {
+    path = boost::filesystem::temp_directory_path();
+    path /= boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%");
+  }
+
+  // zones interleaved and in reverse order, large enough to be split in several slices
+  const int count = 40000;
+  {
+    boost::filesystem::ofstream fo(path);
+    for(int i=count-1; i>=0; --i) {
+      fo << "Zone/B," << i * 1000000LL << "," << (i % 2 ? 3600 : 0) << "," << (i % 2 ? "BDT" : "BST") << "," << (i % 2) << "\n";
+      fo << "Zone/A," << -i * 1000000LL << ",-1800,AST,0\n";
+    }
+    fo << "\"Zone,C\",0,0,\"C,C\",1\n";
+    fo << "Zone/A,0,-3600,DUP,1";
+  }
+  time_zone_database tzdb;
+  BOOST_REQUIRE(tzdb.load_from_file(path.string(), 4));
+  boost::filesystem::remove(path);
+
+  std::set<std::string> expected_region_list = { "Zone,C", "Zone/A", "Zone/B" };
+  std::set<std::string> region_list = tzdb.region_list();
+  BOOST_CHECK_EQUAL_COLLECTIONS(region_list.begin(), region_list.end(), expected_region_list.begin(), expected_region_list.end());
+
+  ptime epoch(boost::gregorian::date(1970, 1, 1));
+  time_zone_const_ptr a = tzdb.time_zone_from_region("Zone/A");
+  time_zone_const_ptr b = tzdb.time_zone_from_region("Zone/B");
+  time_zone_const_ptr c = tzdb.time_zone_from_region("Zone,C");
+  // the first line for a given time wins
+  BOOST_CHECK_EQUAL(local_date_time(epoch, a).to_string(), "19700101T003000 AST");
+  BOOST_CHECK_EQUAL(local_date_time(epoch + boost::posix_time::seconds(101), b).to_string(), "19691231T230141 BDT");
+  BOOST_CHECK_EQUAL(local_date_time(epoch + boost::posix_time::seconds(count + 10), b).to_string(), "19700101T100650 BDT");
+  BOOST_CHECK_EQUAL(local_date_time(epoch, c).to_string(), "19700101T000000 C,C");
+  BOOST_CHECK(local_date_time(epoch, c).is_dst());
+
+  {
+    boost::filesystem::ofstream fo(path);
+    for(int i=0; i<count; ++i)
+      fo << "Zone/B," << i * 1000000LL << ",3600,BDT,1\n";
+    fo << "Zone/B,0,3600\n";
+  }
+  BOOST_CHECK_THROW(tzdb.load_from_file(path.string(), 4), std::runtime_error);
+  boost::filesystem::remove(path);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_database_export) {
+  boost::filesystem::path path;
+  while( path.empty() || boost::filesystem::exists(path) ) {
+    path = boost::filesystem::temp_directory_path();
+    path /= boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%");
+  }
+  auto read_file = [&path]() {
+    boost::filesystem::ifstream fi(path, std::ios::binary);
+    std::string filestr = std::string(std::istreambuf_iterator<char>(fi), std::istreambuf_iterator<char>());
+    fi.close();
+    boost::filesystem::remove(path);
+    return filestr;
+  };
+
+  time_zone_database tzdb( time_zone_database::from_struct(zones_struct_simple) );
+  tzdb.add_record("America/New_York", time_zone_ptr(new time_zone(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo"))));
+
+  { // a subset of the zones, formatted in parallel
+    std::vector<std::string> regions = { "TZ_2", "TZ_5", "XYZ", "TZ_6" };
+    BOOST_CHECK(tzdb.save_to_file(path.string(), regions, time_zone_database::CSV_FORMAT, 3));
+    BOOST_CHECK_EQUAL(read_file(), "TZ_2,0,0,EST,0\nTZ_2,86400000000,-3600,DST,1\nTZ_5,0,0,EST,1\nTZ_5,86400000000,-3600,DST,0\nTZ_6,0,0,EST,0\nTZ_6,86400000000,-3600,DST,0\n");
+  }
+  { // the parallel output matches the sequential one
+    BOOST_CHECK(tzdb.save_to_file(path.string()));
+    std::string sequential = read_file();
+    BOOST_CHECK(tzdb.save_to_file(path.string(), tzdb.region_list(), time_zone_database::CSV_FORMAT, 4));
+    BOOST_CHECK_EQUAL(read_file(), sequential);
+    BOOST_CHECK(sequential.find("America/New_York,-2717650800000000,18000,EST,0\n") != std::string::npos);
+
+    // enough zones for several rounds of blocks
+    time_zone_database many;
+    for(int i=0; i<400; ++i)
+      many.add_record("Zone_" + std::to_string(1000 + i), std::make_shared<time_zone>(*tzdb.time_zone_from_region("America/New_York")));
+    BOOST_CHECK(many.save_to_file(path.string(), many.region_list(), time_zone_database::BINARY_FORMAT, 1));
+    sequential = read_file();
+    BOOST_CHECK(many.save_to_file(path.string(), many.region_list(), time_zone_database::BINARY_FORMAT, 2));
+    BOOST_CHECK(read_file() == sequential);
+  }
+  { // binary round trip
+    BOOST_CHECK(tzdb.save_to_file(path.string(), time_zone_database::BINARY_FORMAT));
+    time_zone_database tzdb2( time_zone_database::from_binary(path.string()) );
+    boost::filesystem::remove(path);
+    BOOST_CHECK(time_zone_database::diff(tzdb, tzdb2).changes.empty());
+    BOOST_CHECK(time_zone_database::diff(tzdb2, tzdb).changes.empty());
+
+    ptime p(boost::gregorian::date(2015, 3, 8), time_duration(7,0,0));
+    BOOST_CHECK_EQUAL(local_date_time(p, tzdb2.time_zone_from_region("America/New_York")).to_iso_string(), "20150308T030000-0400");
+
+    boost::filesystem::ofstream fo(path);
+    fo << "LDTB";
+    fo.close();
+    BOOST_CHECK_THROW(time_zone_database::from_binary(path.string()), std::runtime_error);
+    boost::filesystem::remove(path);
+    BOOST_CHECK_THROW(time_zone_database::from_binary(path.string()), std::runtime_error);
+
+    // names and abbreviations too long for the binary fields fail instead of being cut
+    time_zone_ptr long_abbr(new time_zone("LONG"));
+    long_abbr->add_entry(0, time_zone_entry_info(0, std::string(256, 'A'), false));
+    tzdb.add_record("LONG", long_abbr);
+    BOOST_CHECK(!tzdb.save_to_file(path.string(), time_zone_database::BINARY_FORMAT));
+    BOOST_CHECK(!boost::filesystem::exists(path));
+    tzdb.delete_record("LONG");
+    tzdb.add_record(std::string(65536, 'Z'), std::make_shared<time_zone>(*tzdb.time_zone_from_region("America/New_York")));
+    BOOST_CHECK(!tzdb.save_to_file(path.string(), time_zone_database::BINARY_FORMAT));
+    tzdb.delete_record(std::string(65536, 'Z'));
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_time_zone_arena) {
+  time_zone_const_ptr tz1, tz2;
+  {
+    time_zone_database tzdb( time_zone_database::from_struct(zones_struct_simple) );
+    tz1 = tzdb.time_zone_from_region("TZ_1");
+    tz2 = tzdb.time_zone_from_region("TZ_2");
+
+    // all the zones of a snapshot come from a single block
+    BOOST_REQUIRE(tz1->get_allocator().resource());
+    BOOST_CHECK(tz1->get_allocator() == tz2->get_allocator());
+    BOOST_CHECK_EQUAL(tz1->get_allocator().resource()->blocks(), 1u);
+  }
+
+  // the zones keep the arena alive after the database is gone
+  ptime p(boost::gregorian::date(2000, 1, 1));
+  BOOST_CHECK_EQUAL(local_date_time(p, tz1).to_string(), "19991231T230000 DST");
+  BOOST_CHECK_EQUAL(local_date_time(p, tz2).to_string(), "20000101T010000 DST");
+
+  // copies are allocated on the heap
+  time_zone_ptr dup = time_zone::duplicate(tz1);
+  BOOST_CHECK(!dup->get_allocator().resource());
+  time_zone copy(*tz2);
+  BOOST_CHECK(!copy.get_allocator().resource());
+  BOOST_CHECK_EQUAL(local_date_time(p, dup).to_string(), "19991231T230000 DST");
+
+  detail::arena a(16);
+  void* p1 = a.allocate(3, 1);
+  void* p2 = a.allocate(8, 8);
+  BOOST_CHECK_EQUAL(reinterpret_cast<std::uintptr_t>(p2) % 8, 0u);
+  BOOST_CHECK(p1 != p2);
+  a.allocate(64, 8);
+  BOOST_CHECK_EQUAL(a.blocks(), 2u);
+  BOOST_CHECK_EQUAL(a.used(), 75u);
+}
+
+
+#ifdef LOCAL_TIME_STATISTICS
+BOOST_AUTO_TEST_CASE(test_statistics) {
+  time_zone_database tzdb( time_zone_database::from_struct(zones_struct_simple) );
+  BOOST_CHECK_EQUAL(tzdb.statistics().loads, 1u);
+
+  BOOST_CHECK(!tzdb.time_zone_from_region("ABCDEF"));
+  time_zone_const_ptr tz = tzdb.time_zone_from_region("TZ_1");
+  time_zone_const_ptr tz2 = tzdb.time_zone_from_region("TZ_2");
+  BOOST_CHECK_EQUAL(tzdb.statistics().lookup_hits, 2u);
+  BOOST_CHECK_EQUAL(tzdb.statistics().lookup_misses, 1u);
+
+  auto d1 = boost::gregorian::date(1970, 1, 1);
+  auto d2 = boost::gregorian::date(1970, 1, 2);
+  local_date_time(d1, time_duration(5,0,0), tz);
+  local_date_time(d1, time_duration(23,0,0), tz, time_zone::ASSUME_DST);
+  BOOST_CHECK_THROW(local_date_time(d1, time_duration(23,0,0), tz), ambiguous_result);
+  BOOST_CHECK_THROW(local_date_time(d2, time_duration(0,30,0), tz2), time_label_invalid);
+  local_date_time(ptime(d2), tz).to_string();
+
+  time_zone_statistics st = tz->statistics();
+  BOOST_CHECK_EQUAL(st.local_lookups, 3u);
+  BOOST_CHECK_EQUAL(st.utc_lookups, 1u);
+  BOOST_CHECK_EQUAL(st.ambiguous[time_zone::ASSUME_DST], 1u);
+  BOOST_CHECK_EQUAL(st.ambiguous[time_zone::ASSUME_NON_DST], 0u);
+  BOOST_CHECK_EQUAL(st.ambiguous[time_zone::THROW_ON_AMBIGUOUS], 1u);
+  BOOST_CHECK_EQUAL(tzdb.zone_statistics()["TZ_2"].invalid[time_zone::THROW_ON_AMBIGUOUS], 1u);
+
+  std::ostringstream out;
+  tzdb.export_statistics(out);
+  BOOST_CHECK(out.str().find("database,lookup_misses,1\n") != std::string::npos);
+  BOOST_CHECK(out.str().find("TZ_1,ambiguous_assume_dst,1\n") != std::string::npos);
+
+  tzdb.reset_statistics();
+  BOOST_CHECK_EQUAL(tzdb.statistics().lookup_hits, 0u);
+  BOOST_CHECK_EQUAL(tz->statistics().local_lookups, 0u);
+  BOOST_CHECK_EQUAL(tzdb.statistics().loads, 1u);
+}
+#endif //LOCAL_TIME_STATISTICS
+
+
+BOOST_AUTO_TEST_CASE(test_zoneinfo_writer) {
+  boost::filesystem::path path;
+  while( path.empty() || boost::filesystem::exists(path) ) {
+    path = boost::filesystem::temp_directory_path();
+    path /= boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%");
+  }
+
+  time_zone_database tzdb( time_zone_database::from_struct(zones_struct_simple) );
+  tzdb.add_record("America/New_York", time_zone_ptr(new time_zone(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo"))));
+  tzdb.add_record("Asia/Kolkata", time_zone_ptr(new time_zone(time_zone::from_zoneinfo("Asia/Kolkata", "/usr/share/zoneinfo"))));
+  tzdb.add_record("UTC", time_zone_ptr(new time_zone(time_zone::from_zoneinfo("UTC", "/usr/share/zoneinfo"))));
+
+  BOOST_CHECK_EQUAL(tzdb.time_zone_from_region("Asia/Kolkata")->posix_footer(), "IST-5:30");
+  BOOST_CHECK_EQUAL(tzdb.time_zone_from_region("UTC")->posix_footer(), "UTC0");
+  BOOST_CHECK_EQUAL(tzdb.time_zone_from_region("TZ_4")->posix_footer(), "<EST2>1");
+  BOOST_CHECK_EQUAL(tzdb.time_zone_from_region("TZ_6")->posix_footer(), "DST-1");
+  BOOST_CHECK_EQUAL(tzdb.time_zone_from_region("TZ_1")->posix_footer(), "");
+
+  // writing and reading back gives the same database
+  time_zone_database reread;
+  std::set<std::string> regions = tzdb.region_list();
+  for(auto it=regions.begin(); it!=regions.end(); ++it) {
+    tzdb.time_zone_from_region(*it)->to_zoneinfo(path.string(), tzdb.time_zone_from_region(*it)->posix_footer(), *it == "UTC" ? '3' : '2');
+    reread.add_record(*it, time_zone_ptr(new time_zone(time_zone::from_zoneinfo(*it, path.string()))));
+  }
+  BOOST_CHECK(time_zone_database::diff(tzdb, reread).changes.empty());
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(2015,3,21), boost::posix_time::hours(12)), reread.time_zone_from_region("Asia/Kolkata")).local_time(), ptime(boost::gregorian::date(2015,3,21), boost::posix_time::hours(17) + boost::posix_time::minutes(30)));
+
+  { // the footer follows the 64 bit block
+    tzdb.time_zone_from_region("Asia/Kolkata")->to_zoneinfo(path.string());
+    boost::filesystem::ifstream fi(path / "Asia/Kolkata", std::ios::binary);
+    std::string filestr = std::string(std::istreambuf_iterator<char>(fi), std::istreambuf_iterator<char>());
+    BOOST_CHECK_EQUAL(filestr.substr(0, 5), "TZif2");
+    BOOST_CHECK_EQUAL(filestr.substr(filestr.size() - 10), "\nIST-5:30\n");
+  }
+
+  BOOST_CHECK_THROW(tzdb.time_zone_from_region("TZ_1")->to_zoneinfo(path.string(), "", '1'), std::runtime_error);
+  BOOST_CHECK_THROW(time_zone("EMPTY").to_zoneinfo(path.string()), std::runtime_error);
+  boost::filesystem::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(test_shared_database) {
+  std::string name = "/local_time_test_" + std::to_string(::getpid());
+  BOOST_CHECK_EQUAL(time_zone_database::shared_generation(name), 0u);
+  BOOST_CHECK_THROW(time_zone_database::from_shared(name), std::runtime_error);
+
+  time_zone_database tzdb( time_zone_database::from_struct(zones_struct_simple) );
+  tzdb.add_record("America/New_York", time_zone_ptr(new time_zone(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo"))));
+  BOOST_CHECK(tzdb.publish_shared(name));
+  BOOST_CHECK_EQUAL(time_zone_database::shared_generation(name), 1u);
+
+  time_zone_database reader = time_zone_database::from_shared(name);
+  BOOST_CHECK_EQUAL(reader.generation(), 1u);
+  BOOST_CHECK(time_zone_database::diff(tzdb, reader).changes.empty());
+  time_zone_const_ptr ny = reader.time_zone_from_region("America/New_York");
+  BOOST_CHECK_EQUAL(ny->kind(), time_zone::VARIABLE_OFFSET_ZONE);
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(2015,3,21), boost::posix_time::hours(12)), ny).local_time(), ptime(boost::gregorian::date(2015,3,21), boost::posix_time::hours(8)));
+  BOOST_CHECK_THROW(local_date_time(boost::gregorian::date(2015,3,8), boost::posix_time::hours(2), ny), local_time::time_label_invalid);
+
+  // a new generation replaces the old one, readers attached to it keep their view
+  tzdb.delete_record("TZ_1");
+  BOOST_CHECK(tzdb.publish_shared(name));
+  BOOST_CHECK_EQUAL(time_zone_database::shared_generation(name), 2u);
+  BOOST_CHECK(reader.time_zone_from_region("TZ_1"));
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(2015,7,1), boost::posix_time::hours(12)), ny).local_time(), ptime(boost::gregorian::date(2015,7,1), boost::posix_time::hours(8)));
+  time_zone_database refreshed;
+  BOOST_CHECK(refreshed.load_from_shared(name));
+  BOOST_CHECK_EQUAL(refreshed.generation(), 2u);
+  BOOST_CHECK(!refreshed.time_zone_from_region("TZ_1"));
+  BOOST_CHECK(time_zone_database::diff(tzdb, refreshed).changes.empty());
+
+  // copies of shared zones can be modified
+  time_zone_ptr copy(new time_zone(*refreshed.time_zone_from_region("TZ_2")));
+  copy->add_entry(3600LL*48*1000000, time_zone_entry_info(0, "EST", false));
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(1970,1,4)), copy).local_time(), ptime(boost::gregorian::date(1970,1,4)));
+  BOOST_CHECK_EQUAL(refreshed.time_zone_from_region("TZ_2")->kind(), time_zone::VARIABLE_OFFSET_ZONE);
+
+  // corrupted segments are rejected: a bucket past the end of the tables, then counts not matching the kind of a zone
+  std::string segment = name + "." + std::to_string(time_zone_database::shared_generation(name));
+  int fd = ::shm_open(segment.c_str(), O_RDWR, 0);
+  BOOST_REQUIRE(fd >= 0);
+  struct stat st;
+  BOOST_REQUIRE(::fstat(fd, &st) == 0);
+  void* p = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  BOOST_REQUIRE(p != MAP_FAILED);
+  char* base = static_cast<char*>(p);
+  const detail::shared_header* header = reinterpret_cast<const detail::shared_header*>(base);
+  detail::shared_zone* zones = reinterpret_cast<detail::shared_zone*>(base + header->zones);
+  detail::shared_zone* variable = std::find_if(zones, zones + header->zone_count, [](const detail::shared_zone& z) { return z.kind == time_zone::VARIABLE_OFFSET_ZONE; });
+  BOOST_REQUIRE(variable != zones + header->zone_count);
+  const detail::shared_zone original = *variable;
+  uint16_t* bucket = reinterpret_cast<uint16_t*>(base + variable->utc_bucket) + 40;
+  const uint16_t original_bucket = *bucket;
+  *bucket = static_cast<uint16_t>(variable->count);
+  BOOST_CHECK_THROW(time_zone_database::from_shared(name), std::runtime_error);
+  *bucket = original_bucket;
+  variable->count = 1;
+  BOOST_CHECK_THROW(time_zone_database::from_shared(name), std::runtime_error);
+  variable->kind = time_zone::FIXED_OFFSET_ZONE;
+  variable->count = 0;
+  BOOST_CHECK_THROW(time_zone_database::from_shared(name), std::runtime_error);
+  *variable = original;
+  BOOST_CHECK(time_zone_database::diff(tzdb, time_zone_database::from_shared(name)).changes.empty());
+  ::munmap(p, st.st_size);
+
+  BOOST_CHECK(time_zone_database::remove_shared(name));
+  BOOST_CHECK_EQUAL(time_zone_database::shared_generation(name), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_rezone) {
+  time_zone_ptr ny(new time_zone(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo")));
+  time_zone_ptr london(new time_zone(time_zone::from_zoneinfo("Europe/London", "/usr/share/zoneinfo")));
+  time_zone_ptr utc(new time_zone(time_zone::from_zoneinfo("UTC", "/usr/share/zoneinfo")));
+  time_zone_ptr gmt5(new time_zone(time_zone::from_zoneinfo("Etc/GMT+5", "/usr/share/zoneinfo")));
+
+  // every 7 hours and 13 minutes over a few years, skipping the local times that do not exist in New York
+  std::vector<ptime> local;
+  for(ptime p(boost::gregorian::date(2012,1,1)); p < ptime(boost::gregorian::date(2016,1,1)); p += boost::posix_time::minutes(433))
+    if(local_date_time::try_from_local(p, ny, time_zone::ASSUME_DST).valid())
+      local.push_back(p);
+  std::vector<ptime> expected;
+  for(auto it=local.begin(); it!=local.end(); ++it)
+    expected.push_back(local_date_time(it->date(), it->time_of_day(), ny, time_zone::ASSUME_DST).local_time_in(london).local_time());
+
+  { // sorted input
+    std::vector<ptime> result;
+    time_zone::rezone(*ny, *london, local.begin(), local.end(), std::back_inserter(result), time_zone::ASSUME_DST);
+    BOOST_CHECK(result == expected);
+  }
+  { // unsorted input, as microseconds
+    std::vector<int64_t> in, out(local.size());
+    for(std::size_t i=0; i<local.size(); ++i)
+      in.push_back((local[(i * 7919) % local.size()] - ptime(boost::gregorian::date(1970,1,1))).total_microseconds());
+    time_zone::rezone(*ny, *london, in.data(), in.size(), out.data(), time_zone::ASSUME_DST);
+    bool same = true;
+    for(std::size_t i=0; i<local.size(); ++i)
+      same = same && ptime(boost::gregorian::date(1970,1,1)) + boost::posix_time::microseconds(out[i]) == expected[(i * 7919) % local.size()];
+    BOOST_CHECK(same);
+  }
+  { // fixed offsets on both sides, special values kept
+    std::vector<ptime> in = { ptime(boost::gregorian::date(2015,3,21), boost::posix_time::hours(12)), ptime(boost::posix_time::pos_infin) };
+    std::vector<ptime> out(2);
+    time_zone::rezone(*utc, *gmt5, in.begin(), in.end(), out.begin());
+    BOOST_CHECK_EQUAL(out[0], ptime(boost::gregorian::date(2015,3,21), boost::posix_time::hours(7)));
+    BOOST_CHECK(out[1].is_pos_infinity());
+    int64_t t = 0, r = 1;
+    time_zone::rezone(*gmt5, *utc, &t, 1, &r);
+    BOOST_CHECK_EQUAL(r, 5 * 3600LL * 1000000);
+  }
+  { // ambiguous and invalid local times
+    std::vector<ptime> in = { ptime(boost::gregorian::date(2015,11,1), boost::posix_time::minutes(90)) };
+    std::vector<ptime> out;
+    BOOST_CHECK_THROW(time_zone::rezone(*ny, *utc, in.begin(), in.end(), std::back_inserter(out)), local_time::ambiguous_result);
+    in[0] = ptime(boost::gregorian::date(2015,3,8), boost::posix_time::minutes(150));
+    BOOST_CHECK_THROW(time_zone::rezone(*ny, *utc, in.begin(), in.end(), std::back_inserter(out)), local_time::time_label_invalid);
+    time_zone::rezone(*ny, *utc, in.begin(), in.end(), std::back_inserter(out), time_zone::ASSUME_NON_DST);
+    BOOST_CHECK_EQUAL(out[0], ptime(boost::gregorian::date(2015,3,8), boost::posix_time::minutes(450)));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_local_buckets) {
+  time_zone_ptr ny(new time_zone(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo")));
+  time_zone_ptr kolkata(new time_zone(time_zone::from_zoneinfo("Asia/Kolkata", "/usr/share/zoneinfo")));
+  time_zone_ptr sao_paulo(new time_zone(time_zone::from_zoneinfo("America/Sao_Paulo", "/usr/share/zoneinfo")));
+  time_zone_ptr gmt5(new time_zone(time_zone::from_zoneinfo("Etc/GMT+5", "/usr/share/zoneinfo")));
+  const ptime epoch(boost::gregorian::date(1970,1,1));
+  auto micros = [&epoch](const ptime& p) { return (p - epoch).total_microseconds(); };
+
+  // the kernel agrees with local_time().date() before and after the epoch
+  std::vector<int64_t> utc;
+  for(ptime p(boost::gregorian::date(1965,1,1)); p < ptime(boost::gregorian::date(2020,1,1)); p += boost::posix_time::minutes(7919))
+    utc.push_back(micros(p));
+  std::vector<time_zone_ptr> zones = { ny, kolkata, sao_paulo, gmt5 };
+  for(auto z=zones.begin(); z!=zones.end(); ++z) {
+    std::vector<int32_t> days(utc.size());
+    std::vector<int64_t> hours(utc.size()), starts(utc.size());
+    (*z)->local_days(utc.data(), utc.size(), days.data());
+    (*z)->local_hours(utc.data(), utc.size(), hours.data(), starts.data());
+    bool same = true;
+    for(std::size_t i=0; i<utc.size(); ++i) {
+      ptime local = local_date_time(epoch + boost::posix_time::microseconds(utc[i]), *z).local_time();
+      same = same && days[i] == (local.date() - epoch.date()).days();
+      int64_t seconds = (local - epoch).total_seconds();
+      same = same && hours[i] == (seconds >= 0 ? seconds / 3600 : -((3599 - seconds) / 3600));
+      // the start is in the same hour, and the instant before it is not
+      ptime start = epoch + boost::posix_time::microseconds(starts[i]);
+      ptime hour = epoch + boost::posix_time::hours(hours[i]);
+      same = same && starts[i] <= utc[i] && local_date_time(start, *z).local_time() >= hour && local_date_time(start, *z).local_time() < hour + boost::posix_time::hours(1);
+      same = same && local_date_time(start - boost::posix_time::microseconds(1), *z).local_time() < hour;
+    }
+    BOOST_CHECK(same);
+  }
+
+  { // days of 23 hours, and a day whose midnight does not exist
+    std::vector<int64_t> in = { micros(ptime(boost::gregorian::date(2015,3,8), boost::posix_time::hours(20))),
+                                micros(ptime(boost::gregorian::date(2015,3,9), boost::posix_time::hours(3))) };
+    std::vector<int32_t> days(2);
+    std::vector<int64_t> starts(2);
+    ny->local_days(in.data(), in.size(), days.data(), starts.data());
+    BOOST_CHECK_EQUAL(days[0], (boost::gregorian::date(2015,3,8) - epoch.date()).days());
+    BOOST_CHECK_EQUAL(days[1], days[0]);
+    BOOST_CHECK_EQUAL(starts[0], micros(ptime(boost::gregorian::date(2015,3,8), boost::posix_time::hours(5))));
+    BOOST_CHECK_EQUAL(starts[1], starts[0]);
+
+    in[0] = micros(ptime(boost::gregorian::date(2018,11,4), boost::posix_time::hours(12)));
+    sao_paulo->local_days(in.data(), 1, days.data(), starts.data());
+    BOOST_CHECK_EQUAL(starts[0], micros(ptime(boost::gregorian::date(2018,11,4), boost::posix_time::hours(3))));
+  }
+  { // the repeated hour starts at its first occurrence
+    std::vector<int64_t> in = { micros(ptime(boost::gregorian::date(2015,11,1), boost::posix_time::minutes(390))) };
+    std::vector<int64_t> hours(1), starts(1);
+    ny->local_hours(in.data(), 1, hours.data(), starts.data());
+    BOOST_CHECK_EQUAL(hours[0], (ptime(boost::gregorian::date(2015,11,1), boost::posix_time::hours(1)) - epoch).hours());
+    BOOST_CHECK_EQUAL(starts[0], micros(ptime(boost::gregorian::date(2015,11,1), boost::posix_time::hours(5))));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_local_day_boundaries) {
+  time_zone_ptr ny(new time_zone(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo")));
+  time_zone_ptr sao_paulo(new time_zone(time_zone::from_zoneinfo("America/Sao_Paulo", "/usr/share/zoneinfo")));
+  time_zone_ptr gmt5(new time_zone(time_zone::from_zoneinfo("Etc/GMT+5", "/usr/share/zoneinfo")));
+  using boost::gregorian::date;
+  using boost::posix_time::hours;
+
+  // a regular day, then days of 23 and 25 hours
+  BOOST_CHECK_EQUAL(ny->local_day_start(ptime(date(2015,3,21), hours(12))), ptime(date(2015,3,21), hours(4)));
+  BOOST_CHECK_EQUAL(ny->local_day_end(ptime(date(2015,3,21), hours(12))), ptime(date(2015,3,22), hours(4)));
+  BOOST_CHECK_EQUAL(ny->local_day_end(ptime(date(2015,3,8), hours(12))) - ny->local_day_start(ptime(date(2015,3,8), hours(12))), hours(23));
+  BOOST_CHECK_EQUAL(ny->local_day_end(ptime(date(2015,11,1), hours(12))) - ny->local_day_start(ptime(date(2015,11,1), hours(12))), hours(25));
+  // the local day of a UTC time can be the previous UTC day, before the epoch too
+  BOOST_CHECK_EQUAL(ny->local_day_start(ptime(date(2015,3,22), hours(3))), ptime(date(2015,3,21), hours(4)));
+  BOOST_CHECK_EQUAL(ny->local_day_start(ptime(date(1960,1,1), hours(3))), ptime(date(1959,12,31), hours(5)));
+
+  // midnight is skipped: the day starts at 01:00 local time and lasts 23 hours
+  BOOST_CHECK_EQUAL(sao_paulo->local_day_start(ptime(date(2018,11,4), hours(12))), ptime(date(2018,11,4), hours(3)));
+  BOOST_CHECK_EQUAL(sao_paulo->local_day_end(ptime(date(2018,11,3), hours(12))), ptime(date(2018,11,4), hours(3)));
+  // midnight happens twice when the clocks go back: the day starts at the first one
+  BOOST_CHECK_EQUAL(sao_paulo->local_day_start(ptime(date(2019,2,16), hours(12))), ptime(date(2019,2,16), hours(2)));
+  BOOST_CHECK_EQUAL(sao_paulo->local_day_end(ptime(date(2019,2,16), hours(12))), ptime(date(2019,2,17), hours(3)));
+  // the midnights looked up to find those days are not times of the users and are not counted as skipped or repeated
+  time_zone_statistics st = sao_paulo->statistics();
+  BOOST_CHECK_EQUAL(st.invalid[time_zone::THROW_ON_AMBIGUOUS] + st.ambiguous[time_zone::THROW_ON_AMBIGUOUS], 0u);
+
+  // cached values agree with fresh ones, and copies or changes of the zone do not keep stale values
+  time_zone copy(*ny);
+  bool same = true;
+  for(ptime p(date(2010,1,1)); p < ptime(date(2012,1,1)); p += boost::posix_time::minutes(577)) {
+    ptime start = ny->local_day_start(p);
+    same = same && start == copy.local_day_start(p) && start <= p && p < ny->local_day_end(p);
+    same = same && local_date_time(start, ny).local_time() == ptime(local_date_time(p, ny).local_time().date());
+  }
+  BOOST_CHECK(same);
+  // the cache is a single pointer in the zone until a day is filled, and copies start without one
+  BOOST_CHECK_EQUAL(sizeof(detail::day_cache), sizeof(void*));
+  BOOST_CHECK_LT(time_zone(*ny).memory_usage(), ny->memory_usage());
+  ny->add_entry((ptime(date(2011,6,1)) - ptime(date(1970,1,1))).total_microseconds(), time_zone_entry_info(0, "UTC", false));
+  BOOST_CHECK_EQUAL(ny->local_day_start(ptime(date(2011,6,15), hours(12))), ptime(date(2011,6,15)));
+  BOOST_CHECK_EQUAL(copy.local_day_start(ptime(date(2011,6,15), hours(12))), ptime(date(2011,6,15), hours(4)));
+
+  BOOST_CHECK_EQUAL(gmt5->local_day_start(ptime(date(2015,3,21), hours(2))), ptime(date(2015,3,20), hours(5)));
+  BOOST_CHECK(ny->local_day_start(ptime(boost::posix_time::pos_infin)).is_pos_infinity());
+  BOOST_CHECK(ny->local_day_end(ptime(boost::posix_time::not_a_date_time)).is_not_a_date_time());
+}
+
+BOOST_AUTO_TEST_CASE(test_zoneinfo_before_first_transition) {
+  // times before the first transition have the first type of the file, local mean time here
+  time_zone_ptr detroit(new time_zone(time_zone::from_zoneinfo("America/Detroit", "/usr/share/zoneinfo")));
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(1902,7,22), boost::posix_time::time_duration(0,53,9)), detroit).local_time(), ptime(boost::gregorian::date(1902,7,21), boost::posix_time::time_duration(19,20,58)));
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(1950,7,22)), detroit).local_time(), ptime(boost::gregorian::date(1950,7,21), boost::posix_time::hours(19)));
+  time_zone_ptr wet(new time_zone(time_zone::from_zoneinfo("WET", "/usr/share/zoneinfo")));
+  BOOST_CHECK(!local_date_time(ptime(boost::gregorian::date(1961,4,4)), wet).is_dst());
+}
+
+BOOST_AUTO_TEST_CASE(test_nanosecond_resolution) {
+  time_zone_ptr ny(new time_zone(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo")));
+  time_zone_ptr london(new time_zone(time_zone::from_zoneinfo("Europe/London", "/usr/share/zoneinfo")));
+  time_zone_ptr gmt5(new time_zone(time_zone::from_zoneinfo("Etc/GMT+5", "/usr/share/zoneinfo")));
+  const int64_t hour = 3600LL * 1000000000;
+  // 2015-03-08 07:00:00 UTC, when New York moves to EDT
+  const int64_t transition = 1425798000LL * 1000000000;
+
+  BOOST_CHECK_EQUAL(ny->to_local<nanosecond_resolution>(transition - 1), transition - 5 * hour - 1);
+  BOOST_CHECK_EQUAL(ny->to_local<nanosecond_resolution>(transition), transition - 4 * hour);
+  BOOST_CHECK_EQUAL(ny->to_local<nanosecond_resolution>(-1), -5 * hour - 1);
+  BOOST_CHECK_EQUAL(ny->to_local(transition / 1000), (transition - 4 * hour) / 1000);
+  BOOST_CHECK_EQUAL(ny->to_utc<nanosecond_resolution>(transition - 5 * hour - 1), transition - 1);
+  BOOST_CHECK_THROW(ny->to_utc<nanosecond_resolution>(transition - 5 * hour), local_time::time_label_invalid);
+  BOOST_CHECK_EQUAL(ny->to_utc<nanosecond_resolution>(transition - 4 * hour + 7), transition + 7);
+  BOOST_CHECK_EQUAL(gmt5->to_utc<nanosecond_resolution>(123), 5 * hour + 123);
+
+  // the batch kernels agree with the microsecond ones, keeping the nanoseconds
+  std::vector<int64_t> nanos, micros;
+  for(int64_t t=transition - 30 * 24 * hour; t<transition + 30 * 24 * hour; t+=hour / 7 + 13) {
+    nanos.push_back(t);
+    micros.push_back(detail::floor_div<1000>(t));
+  }
+  std::vector<int64_t> out_nanos(nanos.size()), out_micros(nanos.size());
+  time_zone::rezone<nanosecond_resolution>(*london, *ny, nanos.data(), nanos.size(), out_nanos.data(), time_zone::ASSUME_DST);
+  time_zone::rezone(*london, *ny, micros.data(), micros.size(), out_micros.data(), time_zone::ASSUME_DST);
+  std::vector<int32_t> days_nanos(nanos.size()), days_micros(nanos.size());
+  std::vector<int64_t> hours_nanos(nanos.size()), hours_micros(nanos.size()), starts_nanos(nanos.size()), starts_micros(nanos.size());
+  ny->local_days<nanosecond_resolution>(nanos.data(), nanos.size(), days_nanos.data());
+  ny->local_days(micros.data(), micros.size(), days_micros.data());
+  ny->local_hours<nanosecond_resolution>(nanos.data(), nanos.size(), hours_nanos.data(), starts_nanos.data());
+  ny->local_hours(micros.data(), micros.size(), hours_micros.data(), starts_micros.data());
+  bool same = true;
+  for(std::size_t i=0; i<nanos.size(); ++i) {
+    same = same && out_nanos[i] == out_micros[i] * 1000 + (nanos[i] - micros[i] * 1000);
+    same = same && days_nanos[i] == days_micros[i] && hours_nanos[i] == hours_micros[i] && starts_nanos[i] == starts_micros[i] * 1000;
+  }
+  BOOST_CHECK(same);
+
+  // out of order times over the whole nanosecond range miss the cursor and go through the buckets or the binary search
+  const int64_t far[] = { std::numeric_limits<int64_t>::min() + 1000, -2208988800LL * 1000000000 - 3, -1, 0, 4102444800LL * 1000000000 + 5,
+                          transition + 1, 946684800LL * 1000000000, std::numeric_limits<int64_t>::max() };
+  for(int64_t t : far) {
+    const int64_t us = detail::floor_div<1000>(t);
+    BOOST_CHECK_EQUAL(ny->to_local<nanosecond_resolution>(t) - t, (ny->to_local(us) - us) * 1000);
+  }
+  std::vector<int64_t> fixed_hours(1), fixed_starts(1);
+  gmt5->local_hours<nanosecond_resolution>(&transition, 1, fixed_hours.data(), fixed_starts.data());
+  BOOST_CHECK_EQUAL(fixed_starts[0], transition);
+}
+
+BOOST_AUTO_TEST_CASE(test_zoned_instant) {
+  using namespace std::chrono;
+  time_zone_ptr ny(new time_zone(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo")));
+  time_zone_ptr kolkata(new time_zone(time_zone::from_zoneinfo("Asia/Kolkata", "/usr/share/zoneinfo")));
+  // 2015-03-21 12:00:00.123456789 UTC
+  const time_point<system_clock, nanoseconds> utc(nanoseconds(1426939200123456789LL));
+
+  zoned_instant<nanoseconds> zi(utc, ny);
+  BOOST_CHECK(zi.local_time() == nanoseconds(1426939200123456789LL) - hours(4));
+  BOOST_CHECK(zi.is_dst());
+  BOOST_CHECK_EQUAL(zi.abbreviation(), "EDT");
+  BOOST_CHECK(zi.in(kolkata).local_time() == nanoseconds(1426939200123456789LL) + hours(5) + minutes(30));
+  BOOST_CHECK(!zi.in(kolkata).is_dst());
+  BOOST_CHECK(zoned_instant<nanoseconds>::from_local(zi.local_time(), ny) == zi);
+  BOOST_CHECK((zi + hours(24 * 30)).abbreviation() == "EDT" && (zi - hours(24 * 30)).abbreviation() == "EST");
+  BOOST_CHECK((zi + hours(1)) - zi == hours(1));
+  BOOST_CHECK(zi < zi + nanoseconds(1));
+  BOOST_CHECK_THROW(zoned_instant<nanoseconds>::from_local(duration_cast<nanoseconds>(seconds(1425781800)), ny), local_time::time_label_invalid);
+
+  // to and from local_date_time, rounding down to microseconds
+  local_date_time ldt = zi.to_local_date_time();
+  BOOST_CHECK_EQUAL(ldt.local_time(), ptime(boost::gregorian::date(2015,3,21), boost::posix_time::hours(8) + boost::posix_time::microseconds(123456)));
+  BOOST_CHECK(zoned_instant<nanoseconds>(ldt).utc_time() == utc - nanoseconds(789));
+  BOOST_CHECK(local_date_time(time_point<system_clock, nanoseconds>(nanoseconds(-1)), ny).utc_time() == ptime(boost::gregorian::date(1970,1,1)) - boost::posix_time::microseconds(1));
+  BOOST_CHECK_THROW(zoned_instant<nanoseconds>(local_date_time(boost::posix_time::pos_infin, ny)), local_time::local_time_exception);
+
+  // coarser durations, before the epoch too
+  zoned_instant<seconds> zs(time_point<system_clock, seconds>(seconds(-1)), kolkata);
+  BOOST_CHECK(zs.local_time() == seconds(-1) + hours(5) + minutes(30));
+  BOOST_CHECK(zoned_instant<seconds>::from_local(zs.local_time(), kolkata) == zs);
+  BOOST_CHECK(zoned_instant<minutes>(time_point<system_clock, minutes>(minutes(-1)), nullptr).local_time() == minutes(-1));
+  BOOST_CHECK_EQUAL(zoned_instant<>(system_clock::now(), nullptr).abbreviation(), "");
+}
+
+BOOST_AUTO_TEST_CASE(test_leap_seconds) {
+  const int64_t us = 1000000;
+  leap_second_table zone_table = leap_second_table::from_zoneinfo("right/UTC", "/usr/share/zoneinfo");
+  leap_second_table list_table = leap_second_table::from_file("/usr/share/zoneinfo/leap-seconds.list");
+  BOOST_CHECK_EQUAL(zone_table.size(), list_table.size());
+  BOOST_CHECK(!zone_table.empty());
+  BOOST_CHECK_THROW(leap_second_table::from_file("/usr/share/zoneinfo/none.list"), std::runtime_error);
+
+  // 2015-03-21 12:00:00 UTC, 2016-12-31 23:59:59 UTC and 2017-01-01 00:00:00 UTC
+  const int64_t t = INT64_C(1426939200) * us, before = INT64_C(1483228799) * us, after = INT64_C(1483228800) * us;
+  BOOST_CHECK_EQUAL(zone_table.utc_to_tai(t), t + 35 * us);
+  BOOST_CHECK_EQUAL(list_table.utc_to_tai(t), t + 35 * us);
+  BOOST_CHECK_EQUAL(zone_table.utc_to_tai(before), before + 36 * us);
+  BOOST_CHECK_EQUAL(zone_table.utc_to_tai(after), after + 37 * us);
+  BOOST_CHECK_EQUAL(zone_table.tai_to_utc(t + 35 * us), t);
+  // the leap second 2016-12-31 23:59:60 has no UTC time of its own
+  BOOST_CHECK_EQUAL(zone_table.tai_to_utc(before + 37 * us), after);
+  BOOST_CHECK_EQUAL(zone_table.tai_to_utc(before + 37 * us + 500000), after);
+  BOOST_CHECK_EQUAL(zone_table.tai_to_utc(after + 37 * us), after);
+  BOOST_CHECK_EQUAL(zone_table.utc_to_tai<nanosecond_resolution>(t * 1000 + 1), (t + 35 * us) * 1000 + 1);
+  BOOST_CHECK_EQUAL(zone_table.tai_to_utc<nanosecond_resolution>((t + 35 * us) * 1000 + 1), t * 1000 + 1);
+  BOOST_CHECK_EQUAL(leap_second_table().utc_to_tai(t), t);
+  BOOST_CHECK_EQUAL(leap_second_table().tai_to_utc(t), t);
+
+  std::vector<int64_t> utc, tai(100), back(100);
+  for(int i=0; i<100; ++i)
+    utc.push_back(INT64_C(63072000) * us + i * INT64_C(15000000) * us);
+  zone_table.utc_to_tai(utc.data(), utc.size(), tai.data());
+  list_table.tai_to_utc(tai.data(), tai.size(), back.data());
+  BOOST_CHECK(utc == back);
+
+  // right/ zones count the leap seconds but give the same local times
+  time_zone ny = time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo");
+  time_zone right_ny = time_zone::from_zoneinfo("right/America/New_York", "/usr/share/zoneinfo");
+  for(std::size_t i=0; i<utc.size(); ++i)
+    BOOST_CHECK_EQUAL(ny.to_local(utc[i]), right_ny.to_local(utc[i]));
+  BOOST_CHECK_EQUAL(zone_table.tai_to_local(t + 35 * us, ny), t - 4 * 3600 * us);
+  BOOST_CHECK_EQUAL(zone_table.local_to_tai(t - 4 * 3600 * us, ny), t + 35 * us);
+  std::vector<int64_t> local(100);
+  zone_table.tai_to_local(tai.data(), tai.size(), local.data(), ny);
+  for(std::size_t i=0; i<utc.size(); ++i)
+    BOOST_CHECK_EQUAL(local[i], ny.to_local(utc[i]));
+}
+
+BOOST_AUTO_TEST_CASE(test_core_iso_string) {
+  const ptime day(boost::gregorian::date(2015,3,8));
+  const ptime values[] = { day, day + boost::posix_time::hours(2) + boost::posix_time::microseconds(1234), day - boost::posix_time::microseconds(1),
+                           ptime(boost::posix_time::min_date_time), ptime(boost::posix_time::max_date_time),
+                           ptime(boost::posix_time::pos_infin), ptime(boost::posix_time::neg_infin), ptime() };
+  for(std::size_t i=0; i<sizeof(values) / sizeof(values[0]); ++i)
+    BOOST_CHECK_EQUAL(local_time::detail::to_iso_string(values[i]), boost::posix_time::to_iso_string(values[i]));
+}
+
+BOOST_AUTO_TEST_CASE(test_database_watcher) {
+  typedef time_zone_database_watcher::snapshot_ptr snapshot_ptr;
+  const std::chrono::seconds timeout(10);
+  boost::filesystem::path dir;
+  while( dir.empty() || boost::filesystem::exists(dir) ) {
+    dir = boost::filesystem::temp_directory_path();
+    dir /= boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%");
+  }
+  boost::filesystem::create_directories(dir / "zoneinfo" / "America");
+  boost::filesystem::path file = dir / "tz.csv";
+  // replace the file the way tzdata updates do, by renaming a new one over it
+  auto write = [&dir, &file](const std::string& text) {
+    boost::filesystem::ofstream(dir / "tz.tmp") << text;
+    boost::filesystem::rename(dir / "tz.tmp", file);
+  };
+  write("TZ_1,0,0,AAA,0\n");
+
+  {
+    time_zone_database_watcher watcher(time_zone_database_watcher::CSV_FILE, file.string(), std::vector<std::string>(), 20);
+    snapshot_ptr first = watcher.snapshot();
+    BOOST_CHECK(first->time_zone_from_region("TZ_1"));
+    BOOST_CHECK_EQUAL(watcher.generation(), 1u);
+    std::atomic<int> calls(0), failures(0);
+    watcher.on_refresh([&calls, &failures](const snapshot_ptr& s, std::exception_ptr e) { ++calls; failures += e ? 1 : 0; BOOST_CHECK(s); });
+
+    std::shared_future<snapshot_ptr> next = watcher.next_snapshot();
+    write("TZ_1,0,0,AAA,0\nTZ_2,0,3600,BBB,1\n");
+    BOOST_REQUIRE(next.wait_for(timeout) == std::future_status::ready);
+    BOOST_CHECK(next.get()->time_zone_from_region("TZ_2"));
+    BOOST_CHECK_EQUAL(watcher.snapshot(), next.get());
+    BOOST_CHECK_EQUAL(watcher.generation(), 2u);
+    // readers of the old snapshot keep it
+    BOOST_CHECK(!first->time_zone_from_region("TZ_2"));
+
+    // a broken file is reported and the snapshot kept
+    next = watcher.next_snapshot();
+    write("TZ_1,0,0\n");
+    BOOST_REQUIRE(next.wait_for(timeout) == std::future_status::ready);
+    BOOST_CHECK_THROW(next.get(), std::exception);
+    BOOST_CHECK(watcher.snapshot()->time_zone_from_region("TZ_2"));
+    BOOST_CHECK_EQUAL(watcher.generation(), 2u);
+
+    // other files of the directory are ignored, a forced refresh reloads at once
+    boost::filesystem::ofstream(dir / "other.csv") << "TZ_9,0,0,AAA,0\n";
+    write("TZ_3,0,0,CCC,0\n");
+    next = watcher.refresh();
+    BOOST_REQUIRE(next.wait_for(timeout) == std::future_status::ready);
+    BOOST_CHECK(next.get()->time_zone_from_region("TZ_3"));
+    BOOST_CHECK(!next.get()->time_zone_from_region("TZ_9"));
+    BOOST_CHECK_GE(calls.load(), 3);
+    BOOST_CHECK_EQUAL(failures.load(), 1);
+  }
+  BOOST_CHECK_THROW(time_zone_database_watcher(time_zone_database_watcher::BINARY_FILE, file.string()), std::runtime_error);
+
+  // zoneinfo directory: changed, new and removed zone files, new subdirectories included
+  boost::filesystem::path zoneinfo = dir / "zoneinfo";
+  boost::filesystem::copy_file("/usr/share/zoneinfo/America/New_York", zoneinfo / "America" / "New_York");
+  boost::filesystem::copy_file("/usr/share/zoneinfo/Asia/Kolkata", zoneinfo / "Kolkata");
+  // region names do not depend on how the directory is spelled
+  BOOST_CHECK(time_zone_database_watcher(time_zone_database_watcher::ZONEINFO_DIRECTORY, zoneinfo.string() + "/").snapshot()->time_zone_from_region("America/New_York"));
+  {
+    time_zone_database_watcher watcher(time_zone_database_watcher::ZONEINFO_DIRECTORY, zoneinfo.string(), std::vector<std::string>(), 20);
+    BOOST_CHECK_EQUAL(watcher.snapshot()->region_list().size(), 2u);
+    time_zone_const_ptr ny = watcher.snapshot()->time_zone_from_region("America/New_York");
+
+    std::shared_future<snapshot_ptr> next = watcher.next_snapshot();
+    boost::filesystem::create_directories(zoneinfo / "Europe");
+    boost::filesystem::copy_file("/usr/share/zoneinfo/Europe/London", zoneinfo / "Europe" / "London");
+    BOOST_REQUIRE(next.wait_for(timeout) == std::future_status::ready);
+    while(!watcher.snapshot()->time_zone_from_region("Europe/London")) {
+      next = watcher.next_snapshot();
+      BOOST_REQUIRE(next.wait_for(timeout) == std::future_status::ready);
+    }
+    // untouched zones are shared with the previous snapshot
+    BOOST_CHECK_EQUAL(watcher.snapshot()->time_zone_from_region("America/New_York"), ny);
+
+    next = watcher.next_snapshot();
+    boost::filesystem::remove(zoneinfo / "Kolkata");
+    BOOST_REQUIRE(next.wait_for(timeout) == std::future_status::ready);
+    BOOST_CHECK(!next.get()->time_zone_from_region("Kolkata"));
+    BOOST_CHECK_EQUAL(next.get()->region_list().size(), 2u);
+  }
+  {
+    // a list of zones keeps only those
+    std::vector<std::string> zones(1, "America/New_York");
+    time_zone_database_watcher watcher(time_zone_database_watcher::ZONEINFO_DIRECTORY, zoneinfo.string(), zones, 20);
+    BOOST_CHECK_EQUAL(watcher.snapshot()->region_list().size(), 1u);
+    std::shared_future<snapshot_ptr> next = watcher.next_snapshot();
+    boost::filesystem::remove(zoneinfo / "Europe" / "London");
+    boost::filesystem::copy_file("/usr/share/zoneinfo/America/Chicago", zoneinfo / "America" / "New_York", boost::filesystem::copy_option::overwrite_if_exists);
+    BOOST_REQUIRE(next.wait_for(timeout) == std::future_status::ready);
+    BOOST_CHECK_EQUAL(next.get()->region_list().size(), 1u);
+    BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(2015,1,1)), next.get()->time_zone_from_region("America/New_York")).to_string(), "20141231T180000 CST");
+  }
+  boost::filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_CASE(test_abbreviation_index) {
+  time_zone_database db;
+  const char* names[] = { "America/New_York", "America/Chicago", "Asia/Kolkata", "Asia/Jerusalem", "Europe/Dublin", "Europe/London", "UTC" };
+  for(std::size_t i=0; i<sizeof(names) / sizeof(names[0]); ++i)
+    db.add_record(names[i], std::make_shared<time_zone>(time_zone::from_zoneinfo(names[i], "/usr/share/zoneinfo")));
+  const ptime noon(boost::gregorian::date(2015,3,21), boost::posix_time::hours(12));
+
+  // EDT is 4 hours behind UTC, so its entries add 14400 seconds to local times
+  std::vector<time_zone_abbreviation_use> uses = db.abbreviation_uses("EDT", 14400, true);
+  BOOST_REQUIRE(!uses.empty());
+  BOOST_CHECK_EQUAL(uses[0].zone, "America/New_York");
+  BOOST_CHECK(std::any_of(uses.begin(), uses.end(), [](const time_zone_abbreviation_use& u) { return u.from <= INT64_C(1426939200000000) && INT64_C(1426939200000000) < u.to; }));
+  BOOST_CHECK(db.abbreviation_uses("EDT", 14400, false).empty());
+  BOOST_CHECK(db.abbreviation_uses("XYZ", 0, false).empty());
+
+  local_date_time ldt = local_date_time::from_string("20150321T120000 EDT", db);
+  BOOST_CHECK_EQUAL(ldt.utc_time(), noon + boost::posix_time::hours(4));
+  BOOST_CHECK_EQUAL(ldt.zone()->name(), "America/New_York");
+  BOOST_CHECK_EQUAL(local_date_time::from_string("20150321T120000.123456789 CDT", db).utc_time(), noon + boost::posix_time::hours(5) + boost::posix_time::microseconds(123456));
+  BOOST_CHECK_EQUAL(local_date_time::from_string("20150321T080000-0400", db).utc_time(), noon);
+  BOOST_CHECK_EQUAL(local_date_time::from_string("20150321T173000+0530", db).zone()->name(), "Asia/Kolkata");
+  // no suffix is UTC, found in the first zone by name then on GMT
+  BOOST_CHECK_EQUAL(local_date_time::from_string("20150321T120000", db).zone()->name(), "Europe/Dublin");
+  BOOST_CHECK_EQUAL(local_date_time::from_string("20150321T120000", db).utc_time(), noon);
+  // IST was current in Kolkata and Jerusalem with different offsets
+  BOOST_CHECK_THROW(local_date_time::from_string("20150321T120000 IST", db), local_time::ambiguous_result);
+  BOOST_CHECK_EQUAL(db.abbreviation_uses("IST", -19800, false).back().zone, "Asia/Kolkata");
+  BOOST_CHECK_THROW(local_date_time::from_string("20150121T120000 EDT", db), local_time::time_label_invalid);
+  BOOST_CHECK_THROW(local_date_time::from_string("20150121T120000 XYZ", db), local_time::time_label_invalid);
+  BOOST_CHECK_THROW(local_date_time::from_string("20150121T120000+0300", db), local_time::time_label_invalid);
+  const char* malformed[] = { "2015", "20150121 120000 EDT", "20151321T120000 EDT", "20150121T250000 EDT", "20150121T120000.", "20150121T120000+03", "20150121T120000x" };
+  for(std::size_t i=0; i<sizeof(malformed) / sizeof(malformed[0]); ++i)
+    BOOST_CHECK_THROW(local_date_time::from_string(malformed[i], db), std::runtime_error);
+
+  // the index follows changes of the database
+  time_zone_ptr abc(new time_zone("ABC"));
+  abc->add_entry(0, time_zone_entry_info(-3600, "ABC", false));
+  db.add_record("ABC", abc);
+  BOOST_CHECK_EQUAL(local_date_time::from_string("20150321T130000 ABC", db).utc_time(), noon);
+  db.delete_record("ABC");
+  BOOST_CHECK_THROW(local_date_time::from_string("20150321T130000 ABC", db), local_time::time_label_invalid);
+
+  // null records are left out of the index, and an alias region finds the zone it shares with its target
+  time_zone_database aliased(db);
+  aliased.add_record("Null/Zone", time_zone_ptr());
+  aliased.add_record("US/Eastern", std::const_pointer_cast<time_zone>(db.time_zone_from_region("America/New_York")));
+  aliased.delete_record("America/New_York");
+  BOOST_CHECK_EQUAL(aliased.abbreviation_uses("EDT", 14400, true).size(), uses.size());
+  BOOST_CHECK_EQUAL(aliased.abbreviation_uses("EDT", 14400, true)[0].zone, "US/Eastern");
+  BOOST_CHECK_EQUAL(local_date_time::from_string("20150321T120000 EDT", aliased).zone()->name(), "America/New_York");
+  BOOST_CHECK_EQUAL(local_date_time::from_string("20150321T120000 EDT", aliased).utc_time(), noon + boost::posix_time::hours(4));
+
+  // both string forms of times spread over a few years parse back, unless the abbreviation is ambiguous
+  std::size_t parsed = 0;
+  for(std::size_t i=0; i<sizeof(names) / sizeof(names[0]); ++i) {
+    time_zone_const_ptr tz = db.time_zone_from_region(names[i]);
+    for(ptime p(boost::gregorian::date(2010,1,1)); p<ptime(boost::gregorian::date(2013,1,1)); p+=boost::posix_time::minutes(397)) {
+      local_date_time l(p, tz);
+      BOOST_CHECK_EQUAL(local_date_time::from_string(l.to_iso_string(), db).utc_time(), p);
+      try {
+        BOOST_CHECK_EQUAL(local_date_time::from_string(l.to_string(), db).utc_time(), p);
+        ++parsed;
+      }
+      catch(const local_time::ambiguous_result&) { }
+    }
+  }
+  BOOST_CHECK_GT(parsed, 15000u);
+
+  // copies taken while another thread builds the index get either no index or the whole one
+  for(int round=0; round<20; ++round) {
+    time_zone_database source(db);
+    std::thread reader([&source]() { source.abbreviation_uses("EDT", 14400, true); });
+    time_zone_database copy(source);
+    time_zone_database assigned;
+    assigned = source;
+    reader.join();
+    BOOST_CHECK_EQUAL(copy.abbreviation_uses("EDT", 14400, true).size(), uses.size());
+    BOOST_CHECK_EQUAL(assigned.abbreviation_uses("CDT", 18000, true).size(), db.abbreviation_uses("CDT", 18000, true).size());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_memory_usage_and_compact) {
+  time_zone_database db;
+  const char* names[] = { "America/New_York", "Europe/London", "Asia/Kolkata", "UTC" };
+  for(std::size_t i=0; i<sizeof(names) / sizeof(names[0]); ++i)
+    db.add_record(names[i], std::make_shared<time_zone>(time_zone::from_zoneinfo(names[i], "/usr/share/zoneinfo")));
+  // a second name for a zone is counted once
+  time_zone_ptr ny = std::make_shared<time_zone>(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo"));
+  db.add_record("America/New_York", ny);
+  db.add_record("US/Eastern", ny);
+  auto local = [](time_zone_const_ptr tz, const ptime& p) { return local_date_time(p, tz).local_time(); };
+  ny->to_local(INT64_C(1426939200000000));
+
+  std::size_t zones = 0;
+  for(std::size_t i=0; i<sizeof(names) / sizeof(names[0]); ++i)
+    zones += db.time_zone_from_region(names[i])->memory_usage();
+  std::size_t before = db.memory_usage();
+  BOOST_CHECK_GT(before, zones);
+  BOOST_CHECK_LT(before, zones + 4096);
+
+  time_zone_const_ptr compact = ny->compacted();
+  BOOST_CHECK_LT(compact->memory_usage(), ny->memory_usage());
+  BOOST_CHECK_LT(ny->compacted(2000)->memory_usage(), compact->memory_usage());
+
+  db.compact(2000);
+  BOOST_CHECK_LT(db.memory_usage(), before);
+  BOOST_CHECK_EQUAL(db.time_zone_from_region("US/Eastern"), db.time_zone_from_region("America/New_York"));
+  time_zone_const_ptr cut = db.time_zone_from_region("America/New_York");
+  BOOST_CHECK(cut != ny);
+  // times from the cutoff on are unchanged, earlier ones take the offset in effect at the cutoff
+  for(ptime p(boost::gregorian::date(2000,1,1)); p<ptime(boost::gregorian::date(2040,1,1)); p+=boost::posix_time::minutes(997)) {
+    BOOST_CHECK_EQUAL(local(cut, p), local(ny, p));
+    BOOST_CHECK_EQUAL(local(compact, p), local(ny, p));
+  }
+  BOOST_CHECK_EQUAL(local(cut, ptime(boost::gregorian::date(1950,7,1))), ptime(boost::gregorian::date(1950,6,30), boost::posix_time::hours(19)));
+  BOOST_CHECK_EQUAL(local(compact, ptime(boost::gregorian::date(1950,7,1))), local(ny, ptime(boost::gregorian::date(1950,7,1))));
+  BOOST_CHECK_EQUAL(local(db.time_zone_from_region("UTC"), ptime(boost::gregorian::date(1950,7,1))), ptime(boost::gregorian::date(1950,7,1)));
+
+  // a compacted zone can still be changed
+  time_zone_ptr edited = cut->compacted();
+  edited->add_entry(INT64_C(2524608000000000), time_zone_entry_info(0, "UTC", false));
+  BOOST_CHECK_EQUAL(local(edited, ptime(boost::gregorian::date(2051,1,1))), ptime(boost::gregorian::date(2051,1,1)));
+  BOOST_CHECK_EQUAL(local(edited, ptime(boost::gregorian::date(2015,1,1))), local(cut, ptime(boost::gregorian::date(2015,1,1))));
+}
+
+BOOST_AUTO_TEST_CASE(test_windowed_loading) {
+  const ptime from(boost::gregorian::date(1990,1,1)), to(boost::gregorian::date(2060,1,1));
+  auto local = [](time_zone_const_ptr tz, const ptime& p) { return local_date_time(p, tz).local_time(); };
+  time_zone_const_ptr full = std::make_shared<time_zone>(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo"));
+  time_zone_const_ptr window = std::make_shared<time_zone>(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo", from, to));
+  BOOST_CHECK_LT(window->memory_usage(), full->memory_usage());
+  for(ptime p=from; p<=to; p+=boost::posix_time::minutes(997))
+    BOOST_CHECK_EQUAL(local(window, p), local(full, p));
+  // earlier times take the offset in effect at from
+  BOOST_CHECK_EQUAL(local(window, ptime(boost::gregorian::date(1950,7,1))), ptime(boost::gregorian::date(1950,6,30), boost::posix_time::hours(19)));
+  BOOST_CHECK_THROW(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo", to, from), std::runtime_error);
+  BOOST_CHECK_THROW(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo", from, ptime()), std::runtime_error);
+
+  // the entry at from itself, and at the start of the window, the first of several entries of a time
+  const std::map<std::string, std::vector<std::tuple<int64_t, long, std::string, bool> > > zones {
+    { "TZ_1", { std::make_tuple(INT64_C(0), 0L, std::string("A"), false), std::make_tuple(INT64_C(86400000000), 3600L, std::string("B"), true),
+                std::make_tuple(INT64_C(172800000000), 0L, std::string("C"), false), std::make_tuple(INT64_C(259200000000), 3600L, std::string("D"), true) } },
+    { "TZ_2", { std::make_tuple(INT64_C(0), 0L, std::string("A"), false), std::make_tuple(INT64_C(259200000000), 3600L, std::string("D"), true) } },
+  };
+  const ptime day1(boost::gregorian::date(1970,1,2)), day2(boost::gregorian::date(1970,1,3));
+  time_zone_database db = time_zone_database::from_struct(zones, day1, day2);
+  auto abbreviation = [](const local_date_time& l) { std::string s = l.to_string(); return s.substr(s.rfind(' ') + 1); };
+  BOOST_CHECK_EQUAL(abbreviation(local_date_time(ptime(boost::gregorian::date(1960,1,1)), db.time_zone_from_region("TZ_1"))), "B");
+  BOOST_CHECK_EQUAL(abbreviation(local_date_time(ptime(boost::gregorian::date(1980,1,1)), db.time_zone_from_region("TZ_1"))), "C");
+  BOOST_CHECK_EQUAL(abbreviation(local_date_time(ptime(boost::gregorian::date(1980,1,1)), db.time_zone_from_region("TZ_2"))), "A");
+  BOOST_CHECK(!db.load_from_struct(zones, day2, day1));
+  BOOST_CHECK_THROW(time_zone_database::from_struct(zones, day2, day1), std::runtime_error);
+
+  boost::filesystem::path path;
+  while( path.empty() || boost::filesystem::exists(path) ) {
+    path = boost::filesystem::temp_directory_path();
+    path /= boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%");
+  }
+  {
+    boost::filesystem::ofstream fo(path);
+    fo << "TZ_1,0,0,A,0\nTZ_1,86400000000,3600,B,1\nTZ_1,86400000000,0,X,0\nTZ_1,172800000000,0,C,0\nTZ_1,259200000000,3600,D,1\nTZ_2,259200000000,3600,D,1\n";
+  }
+  db = time_zone_database::from_file(path.string(), day1 + boost::posix_time::hours(1), day2);
+  BOOST_CHECK(!db.load_from_file(path.string(), day2, day1));
+  boost::filesystem::remove(path);
+  db.save_to_file(path.string());
+  boost::filesystem::ifstream fi(path);
+  std::string filestr = std::string(std::istreambuf_iterator<char>(fi), std::istreambuf_iterator<char>());
+  fi.close();
+  boost::filesystem::remove(path);
+  BOOST_CHECK_EQUAL(filestr, "TZ_1,86400000000,3600,B,1\nTZ_1,172800000000,0,C,0\nTZ_2,259200000000,3600,D,1\n");
+}
+
+BOOST_AUTO_TEST_CASE(test_iso_offset_strings) {
+  // the suffixes follow the offsets of the entries, of the opposite sign
+  BOOST_CHECK_EQUAL(std::string(detail::iso_offset(18000).basic, 5), "-0500");
+  const detail::iso_offset lmt(-(4 * 3600 + 56 * 60 + 2));
+  BOOST_CHECK_EQUAL(std::string(lmt.basic, lmt.basic_size), "+045602");
+  BOOST_CHECK_EQUAL(std::string(lmt.extended, lmt.extended_size), "+04:56:02");
+  const detail::iso_offset large(std::numeric_limits<int32_t>::max());
+  BOOST_CHECK_EQUAL(std::string(large.extended, large.extended_size), "-596523:14:07");
+  BOOST_CHECK_EQUAL(detail::iso_offset(0).basic_size + detail::iso_offset(0).extended_size, 0);
+
+  // the same strings as Boost and stream manipulators write, in both forms
+  auto reference = [](const ptime& utc, const local_date_time& l, bool extended) {
+    ptime local = l.local_time();
+    long offset = (local - utc).total_seconds();
+    std::ostringstream ss;
+    ss << (extended ? boost::posix_time::to_iso_extended_string(local) : boost::posix_time::to_iso_string(local));
+    if(offset) {
+      long a = std::abs(offset);
+      ss << (offset < 0 ? '-' : '+') << std::setfill('0') << std::setw(2) << a / 3600 << (extended ? ":" : "") << std::setw(2) << a / 60 % 60;
+      if(a % 60)
+        ss << (extended ? ":" : "") << std::setw(2) << a % 60;
+    }
+    return ss.str();
+  };
+  const char* names[] = { "America/New_York", "Asia/Kolkata", "Australia/Lord_Howe", "Africa/Monrovia", "UTC" };
+  for(std::size_t i=0; i<sizeof(names) / sizeof(names[0]); ++i) {
+    time_zone_const_ptr tz = std::make_shared<time_zone>(time_zone::from_zoneinfo(names[i], "/usr/share/zoneinfo"));
+    char buf[time_zone::max_iso_string_size];
+    for(ptime p(boost::gregorian::date(1850,1,1), boost::posix_time::microseconds(123)); p<ptime(boost::gregorian::date(2040,1,1)); p+=boost::posix_time::hours(24 * 37 + 5)) {
+      local_date_time l(p, tz);
+      BOOST_CHECK_EQUAL(l.to_iso_string(), reference(p, l, false));
+      BOOST_CHECK_EQUAL(l.to_iso_extended_string(), reference(p, l, true));
+      BOOST_CHECK_EQUAL(std::string(buf, tz->utc_to_local_iso_string(p, buf, true)), l.to_iso_extended_string());
+    }
+  }
+  BOOST_CHECK_EQUAL(local_date_time(ptime(boost::gregorian::date(2015,3,21), boost::posix_time::hours(12)), time_zone_const_ptr()).to_iso_extended_string(), "2015-03-21T12:00:00");
+  BOOST_CHECK_EQUAL(detail::to_iso_extended_string(ptime(boost::posix_time::pos_infin)), "+infinity");
+}
+
+BOOST_AUTO_TEST_CASE(test_time_zone_normalizer) {
+  time_zone_database db;
+  const char* names[] = { "America/New_York", "Europe/London", "Asia/Kolkata", "UTC" };
+  for(std::size_t i=0; i<sizeof(names) / sizeof(names[0]); ++i)
+    db.add_record(names[i], std::make_shared<time_zone>(time_zone::from_zoneinfo(names[i], "/usr/share/zoneinfo")));
+  time_zone_normalizer n(db, std::vector<std::string>(names, names + 4));
+  BOOST_CHECK_EQUAL(n.size(), 4u);
+  BOOST_CHECK_EQUAL(n.index_of("Asia/Kolkata"), 2u);
+  BOOST_CHECK(n.index_of("Asia/Tokyo") == time_zone_normalizer::npos);
+  BOOST_CHECK_EQUAL(n.zone(1).name(), "Europe/London");
+  BOOST_CHECK_THROW(time_zone_normalizer(db, std::vector<std::string>(1, "Asia/Tokyo")), std::runtime_error);
+  BOOST_CHECK_THROW(time_zone_normalizer(std::vector<time_zone_const_ptr>(1)), std::runtime_error);
+
+  // interleaved zones, each converted as its zone would, results in the order of the batch
+  std::vector<zoned_time> batch;
+  std::vector<int64_t> expected;
+  for(int64_t t=INT64_C(1262304000000000); t<INT64_C(1420070400000000); t+=INT64_C(7777777777)) {
+    for(uint32_t z=0; z<4; ++z) {
+      const time_zone& tz = n.zone((z + t / 1000) % 4);
+      int64_t local = tz.to_local(t);
+      try {
+        expected.push_back(tz.to_utc(local));
+        batch.push_back(zoned_time{static_cast<uint32_t>((z + t / 1000) % 4), local});
+      }
+      catch(const local_time::ambiguous_result&) { }
+    }
+  }
+  std::vector<int64_t> out;
+  n.to_utc(batch, out);
+  BOOST_CHECK(out == expected);
+  BOOST_CHECK_EQUAL(n.to_utc(batch[5].zone, batch[5].local), expected[5]);
+  std::vector<int64_t> nanos(batch.size());
+  for(auto it=batch.begin(); it!=batch.end(); ++it)
+    it->local *= 1000;
+  n.to_utc<nanosecond_resolution>(batch.data(), batch.size(), nanos.data());
+  BOOST_CHECK_EQUAL(nanos.back(), expected.back() * 1000);
+
+  // a bad index is reported before anything is converted, an ambiguous time like the zone does
+  batch.push_back(zoned_time{4, 0});
+  std::fill(out.begin(), out.end(), 0);
+  BOOST_CHECK_THROW(n.to_utc(batch.data(), batch.size(), out.data()), std::out_of_range);
+  BOOST_CHECK(std::all_of(out.begin(), out.end(), [](int64_t v) { return v == 0; }));
+  BOOST_CHECK_THROW(n.to_utc(4, 0), std::out_of_range);
+  const zoned_time repeated[] = { { 3, 0 }, { 0, INT64_C(1446341400000000) } };
+  BOOST_CHECK_THROW(n.to_utc(repeated, 2, out.data()), local_time::ambiguous_result);
+  time_zone_normalizer later({ db.time_zone_from_region("America/New_York") }, time_zone::ASSUME_NON_DST);
+  BOOST_CHECK_EQUAL(later.index_of("America/New_York"), 0u);
+  later.to_utc(repeated + 1, 1, out.data());
+  BOOST_CHECK_EQUAL(out[0], INT64_C(1446341400000000) + INT64_C(18000000000));
+}
+
+time_zone core_only_zone();
+int64_t core_only_to_local(const time_zone& tz, int64_t utc);
+
+BOOST_AUTO_TEST_CASE(test_core_only_translation_unit) {
+  // tests_core.cpp includes timezone.hpp alone; zones and lookups cross between it and this file
+  time_zone tz = core_only_zone();
+  BOOST_CHECK_EQUAL(tz.to_local(INT64_C(1425798000000000)), INT64_C(1425798000000000) - INT64_C(14400000000));
+  time_zone ny(time_zone::from_zoneinfo("America/New_York", "/usr/share/zoneinfo"));
+  BOOST_CHECK_EQUAL(core_only_to_local(ny, INT64_C(1425798000000000) - 1), INT64_C(1425798000000000) - 1 - INT64_C(18000000000));
+  BOOST_CHECK_EQUAL(core_only_to_local(tz, 0), -INT64_C(18000000000));
+}
+
 BOOST_AUTO_TEST_CASE(make_gcov_happy) {
   std::unique_ptr<local_time_exception> a(new local_time_exception(""));
   std::unique_ptr<ambiguous_result> b(new ambiguous_result("", ""));
@@ -0,0 +1,17 @@
+// Translation unit of the unit tests that includes the conversion core alone, as programs built without the
+// loaders do; linked with tests.cpp, which includes timezone_loaders.hpp as well.
+#include "timezone.hpp"
+
+using namespace local_time;
+
+//! A zone built with the core alone: EST, then EDT from 2015-03-08 07:00 UTC
+time_zone core_only_zone() {
+  time_zone tz("Core/Only");
+  tz.add_entry(0, time_zone_entry_info(18000, "EST", false));
+  tz.add_entry(INT64_C(1425798000000000), time_zone_entry_info(14400, "EDT", true));
+  return tz;
+}
+
+int64_t core_only_to_local(const time_zone& tz, int64_t utc) {
+  return tz.to_local(utc);
+}
@@ -1,25 +1,38 @@
 #ifndef LOCAL_DATE_TIME_TIMEZONE_HPP
 #define LOCAL_DATE_TIME_TIMEZONE_HPP
 
+#include <algorithm>
 #include <map>
 #include <memory>
 #include <vector>
-#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
-#include <fstream>
 #include <set>
 #include <iterator>
-#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <tuple>
+#include <atomic>
+#include <exception>
+#include <cstring>
+#include <sstream>
+#include <cctype>
+#include <limits>
+#include <unordered_map>
 
 
 #ifdef USE_ZONEINFO
-#include <tuple>
 extern "C" {
 #include "tzfile.h"
 #include "stdint.h"
 }
 #endif //USE_ZONEINFO
 
+#ifdef LOCAL_TIME_STATISTICS
+#include <chrono>
+#define LOCAL_TIME_STAT_INC(counter) (counter).fetch_add(1, std::memory_order_relaxed)
+#else
+#define LOCAL_TIME_STAT_INC(counter) ((void)0)
+#endif //LOCAL_TIME_STATISTICS
+
 
 namespace local_time {
 
@@ -32,15 +45,92 @@ namespace detail {
 
 //! Convert an integer representing the number of microseconds since the epoch to a ptime
 static boost::posix_time::ptime microseconds_to_ptime(int64_t microsecs) {
-  static boost::gregorian::date epoch(1970, 1, 1);
-  long long dt = microsecs / 86400000000ULL;
-  long long tm = microsecs % 86400000000ULL;
-  long h = tm / 3600000000;
-  long m = (tm % 3600000000) / 60000000;
-  long s = (tm % 60000000) / 1000000;
-  long msecs = tm % 1000000;
-  boost::posix_time::ptime pt(epoch + boost::gregorian::days(dt), boost::posix_time::time_duration(h, m, s, msecs));
-  return pt;
+  static boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+  return epoch + boost::posix_time::microseconds(microsecs);
+}
+
+//! Write the n lowest decimal digits of v at out, returning the end
+inline char* write_digits(char* out, unsigned n, uint64_t v) {
+  for(char* p=out + n; p!=out; v/=10)
+    *--p = static_cast<char>('0' + v % 10);
+  return out + n;
+}
+
+//! Longest ISO 8601 time write_iso_string writes, the extended form with nanoseconds
+const std::size_t max_iso_string_size = 32;
+
+//! Write a ptime at out in the ISO 8601 basic form as boost::posix_time::to_iso_string writes it, or in the extended
+//! form as to_iso_extended_string does, returning the end; out must hold max_iso_string_size characters
+inline char* write_iso_string(char* out, const boost::posix_time::ptime& p, bool extended = false) {
+  if(p.is_special()) {
+    const char* s = p.is_pos_infinity() ? "+infinity" : p.is_neg_infinity() ? "-infinity" : "not-a-date-time";
+    std::size_t n = std::strlen(s);
+    std::memcpy(out, s, n);
+    return out + n;
+  }
+  boost::gregorian::date::ymd_type ymd = p.date().year_month_day();
+  time_duration t = p.time_of_day();
+  out = write_digits(out, 4, ymd.year);
+  if(extended) *out++ = '-';
+  out = write_digits(out, 2, ymd.month);
+  if(extended) *out++ = '-';
+  out = write_digits(out, 2, ymd.day);
+  *out++ = 'T';
+  out = write_digits(out, 2, t.hours());
+  if(extended) *out++ = ':';
+  out = write_digits(out, 2, t.minutes());
+  if(extended) *out++ = ':';
+  out = write_digits(out, 2, t.seconds());
+  if(t.fractional_seconds()) {
+    *out++ = '.';
+    out = write_digits(out, time_duration::num_fractional_digits(), t.fractional_seconds());
+  }
+  return out;
+}
+
+//! ISO 8601 basic form of a ptime as boost::posix_time::to_iso_string writes it, without the Boost formatting headers
+inline std::string to_iso_string(const boost::posix_time::ptime& p) {
+  char buf[max_iso_string_size];
+  return std::string(buf, write_iso_string(buf, p));
+}
+
+//! ISO 8601 extended form of a ptime as boost::posix_time::to_iso_extended_string writes it
+inline std::string to_iso_extended_string(const boost::posix_time::ptime& p) {
+  char buf[max_iso_string_size];
+  return std::string(buf, write_iso_string(buf, p, true));
+}
+
+//! Whether [from, to] is a window of UTC times a loader can keep, infinities standing for unbounded ends
+inline bool valid_window(const boost::posix_time::ptime& from, const boost::posix_time::ptime& to) {
+  return !from.is_not_a_date_time() && !to.is_not_a_date_time() && !(to < from);
+}
+
+//! Range of the entries of [first, last), sorted by time, that the window [from, to] needs: the entry in effect at from,
+//! the first of its time if several share it, and the entries after it up to to. At least one entry is kept.
+template<class It, class Time>
+std::pair<It, It> window_bounds(It first, It last, const boost::posix_time::ptime& from, const boost::posix_time::ptime& to, Time time) {
+  typedef typename std::iterator_traits<It>::value_type value_type;
+  auto after = [&](const boost::posix_time::ptime& p, const value_type& v) { return p < time(v); };
+  It begin = std::upper_bound(first, last, from, after);
+  if(begin != first) {
+    --begin;
+    for(It prev=begin; begin != first && !(time(*--prev) < time(*begin)); begin=prev) { }
+  }
+  It end = std::upper_bound(begin, last, to, after);
+  if(end == begin && end != last)
+    ++end;
+  return std::make_pair(begin, end);
+}
+
+//! Heap bytes of a string, none for strings stored in the object itself
+inline std::size_t heap_bytes(const std::string& s) {
+  return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+}
+
+//! Bytes of a std::map or std::set node holding a value of type T: the value and the colour, parent, left and right fields
+template<class T>
+inline std::size_t tree_node_bytes() {
+  return sizeof(T) + 4 * sizeof(void*);
 }
 
 //! Convert a ptime to an integer representing the number of microseconds since the epoch
@@ -49,13 +139,332 @@ static int64_t ptime_to_microseconds(const boost::posix_time::ptime& p) {
   return (p - epoch).total_microseconds();
 }
 
-//!
+//! Convert a UTC offset in seconds to a time_duration, offsets being bounded to 32 bits as in zoneinfo files
 inline static time_duration seconds_to_time_duration(long seconds) {
-  if(seconds / 3600 > std::numeric_limits<time_duration::hour_type>::max() || seconds / 3600 < std::numeric_limits<time_duration::hour_type>::min())
+  if(seconds > std::numeric_limits<int32_t>::max() || seconds < -std::numeric_limits<int32_t>::max())
     throw std::out_of_range("Value is too large");
-  return time_duration(seconds / 3600, (seconds / 3600) / 60, seconds % 60, 0);
+  return time_duration(seconds / 3600, (seconds % 3600) / 60, seconds % 60, 0);
 }
 
+
+//! UTC offset suffixes of ISO 8601 local times, formatted once per distinct entry of a zone: "+hhmm[ss]" and "+hh:mm[:ss]", the
+//! seconds only when not zero, and none for UTC itself. The sign is that of the local time ahead of UTC, the opposite
+//! of the offsets of the entries.
+struct iso_offset {
+  //! Longest suffix, the extended form of the largest offsets time_zone_entry_info accepts
+  static const std::size_t capacity = 16;
+
+  explicit iso_offset(long seconds) : basic_size(0), extended_size(0) {
+    if(!seconds)
+      return;
+    unsigned long s = seconds < 0 ? -seconds : seconds;
+    unsigned long h = s / 3600;
+    unsigned hours = 2;
+    for(unsigned long v=h / 100; v; v/=10)
+      ++hours;
+    char* b = basic;
+    char* e = extended;
+    *b++ = *e++ = seconds < 0 ? '+' : '-';
+    b = write_digits(b, hours, h);
+    e = write_digits(e, hours, h);
+    *e++ = ':';
+    b = write_digits(b, 2, s / 60 % 60);
+    e = write_digits(e, 2, s / 60 % 60);
+    if(s % 60) {
+      *e++ = ':';
+      b = write_digits(b, 2, s % 60);
+      e = write_digits(e, 2, s % 60);
+    }
+    basic_size = static_cast<unsigned char>(b - basic);
+    extended_size = static_cast<unsigned char>(e - extended);
+  }
+
+  //! Write the basic or extended suffix at out, returning the end
+  char* write(char* out, bool extended_form) const {
+    std::memcpy(out, extended_form ? extended : basic, extended_form ? extended_size : basic_size);
+    return out + (extended_form ? extended_size : basic_size);
+  }
+
+  char          basic[capacity];
+  char          extended[capacity];
+  unsigned char basic_size;
+  unsigned char extended_size;
+};
+
+//! Monotonic arena: memory is handed out from a short chain of large blocks and only released when the arena dies
+class arena {
+public:
+  explicit arena(std::size_t initial_size = 4096) : _next_size(initial_size ? initial_size : 4096), _ptr(nullptr), _left(0), _used(0) { }
+
+  arena(const arena&) = delete;
+  arena& operator=(const arena&) = delete;
+
+  ~arena() {
+    for(auto it=_blocks.begin(); it!=_blocks.end(); ++it)
+      ::operator delete(*it);
+  }
+
+  void* allocate(std::size_t n, std::size_t align) {
+    std::size_t pad = padding(_ptr, align);
+    if(pad + n > _left) {
+      std::size_t size = std::max(_next_size, n + align);
+      _ptr = static_cast<char*>(::operator new(size));
+      _blocks.push_back(_ptr);
+      _left = size;
+      _next_size = size * 2;
+      pad = padding(_ptr, align);
+    }
+    void* p = _ptr + pad;
+    _ptr += pad + n;
+    _left -= pad + n;
+    _used += n;
+    return p;
+  }
+
+  //! Number of bytes handed out so far
+  std::size_t used() const { return _used; }
+
+  //! Number of blocks obtained from the global heap
+  std::size_t blocks() const { return _blocks.size(); }
+
+private:
+  std::vector<char*>  _blocks;      //!< blocks owned by the arena
+  std::size_t         _next_size;   //!< size of the next block to allocate
+  char*               _ptr;         //!< first free byte in the current block
+  std::size_t         _left;        //!< free bytes left in the current block
+  std::size_t         _used;        //!< bytes handed out
+
+  static std::size_t padding(const char* p, std::size_t align) {
+    return (align - reinterpret_cast<std::uintptr_t>(p) % align) % align;
+  }
+};
+
+//! Allocator drawing from a shared arena, or from the global heap when no arena is set
+template<class T>
+class arena_allocator {
+public:
+  typedef T value_type;
+
+  arena_allocator() noexcept { }
+
+  explicit arena_allocator(const std::shared_ptr<arena>& a) noexcept : _arena(a) { }
+
+  template<class U>
+  arena_allocator(const arena_allocator<U>& other) noexcept : _arena(other._arena) { }
+
+  T* allocate(std::size_t n) {
+    if(_arena)
+      return static_cast<T*>(_arena->allocate(n * sizeof(T), alignof(T)));
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t) noexcept {
+    if(!_arena)
+      ::operator delete(p);
+  }
+
+  //! Copies of a container never share the arena: it is only filled while a snapshot is being built
+  arena_allocator select_on_container_copy_construction() const { return arena_allocator(); }
+
+  const std::shared_ptr<arena>& resource() const { return _arena; }
+
+  template<class U>
+  bool operator== (const arena_allocator<U>& rhs) const { return _arena == rhs._arena; }
+
+  template<class U>
+  bool operator!= (const arena_allocator<U>& rhs) const { return _arena != rhs._arena; }
+
+private:
+  std::shared_ptr<arena>  _arena;   //!< backing arena, null for the global heap
+
+  template<class U> friend class arena_allocator;
+};
+
+//! Append the decimal representation of an integer
+inline void append_integer(std::string& out, int64_t v) {
+  char buf[20];
+  char* p = buf + sizeof(buf);
+  uint64_t u = v < 0 ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v);
+  do {
+    *--p = static_cast<char>('0' + u % 10);
+    u /= 10;
+  } while(u);
+  if(v < 0)
+    *--p = '-';
+  out.append(p, buf + sizeof(buf) - p);
+}
+
+//! Append the n lowest bytes of an integer, little endian first
+inline void append_le(std::string& out, uint64_t v, int n) {
+  for(int i=0; i<n; ++i, v >>= 8)
+    out.push_back(static_cast<char>(v & 0xff));
+}
+
+//! Read n bytes written by append_le
+inline uint64_t read_le(const char*& p, int n) {
+  uint64_t v = 0;
+  for(int i=0; i<n; ++i)
+    v |= static_cast<uint64_t>(static_cast<unsigned char>(*p++)) << (8 * i);
+  return v;
+}
+
+//! Floor of v / Width; the divisor is a constant so the division compiles to a multiplication and shifts
+template<int64_t Width>
+inline int64_t floor_div(int64_t v) {
+  return (v >= 0 ? v : v - (Width - 1)) / Width;
+}
+
+//! Whether a time in microseconds is not after t, a time in ticks of Ticks per microsecond: a multiplication and no division, without overflowing
+template<int64_t Ticks>
+inline bool reached(int64_t microseconds, int64_t t) {
+  if(Ticks == 1)
+    return microseconds <= t;
+  if(microseconds > std::numeric_limits<int64_t>::max() / Ticks)
+    return false;
+  if(microseconds < std::numeric_limits<int64_t>::min() / Ticks)
+    return true;
+  return microseconds * Ticks <= t;
+}
+
+//! Smallest k such that 2^k >= N: a time in ticks shifted right by it is never past the microsecond it falls in
+template<int64_t N>
+struct ceil_log2 { static const int value = 1 + ceil_log2<(N + 1) / 2>::value; };
+template<>
+struct ceil_log2<1> { static const int value = 0; };
+
+const int64_t   microseconds_per_hour = INT64_C(3600000000);
+const int64_t   microseconds_per_day = 24 * microseconds_per_hour;
+
+//! The segment index buckets [1970, 2100) in slices of 2^45 microseconds, a little over a year each
+const int       index_bucket_shift = 45;
+const int64_t   index_bucket_count = (INT64_C(4102444800000000) >> index_bucket_shift) + 1;
+
+//! Read-only array over memory owned elsewhere, either a vector of the zone or a shared memory segment
+template<class T>
+class table_view {
+public:
+  table_view() : _begin(nullptr), _size(0) { }
+  table_view(const T* begin, std::size_t size) : _begin(begin), _size(size) { }
+
+  const T& operator[](std::size_t i) const { return _begin[i]; }
+  std::size_t size() const { return _size; }
+  bool empty() const { return !_size; }
+  const T* begin() const { return _begin; }
+  const T* end() const { return _begin + _size; }
+
+private:
+  const T*      _begin;
+  std::size_t   _size;
+};
+
+//! Lazily filled table of values per day over [1970, 2100), safe to fill from concurrent readers since every thread
+//! stores the same value. It is a single pointer until the first value is set, then a table of block pointers with
+//! the blocks allocated as they are filled. Copies start empty.
+class day_cache {
+public:
+  static const int64_t  days = 47482;
+  static const int64_t  block_size = 512;
+  static const int64_t  empty = std::numeric_limits<int64_t>::min();
+
+  day_cache() : _table(nullptr) { }
+  day_cache(const day_cache&) : _table(nullptr) { }
+  day_cache& operator=(const day_cache&) { clear(); return *this; }
+  ~day_cache() { clear(); }
+
+  //! Cached value of a day, empty if it is outside the table or not filled yet
+  int64_t get(int64_t day) const {
+    if(day < 0 || day >= days)
+      return empty;
+    const block_table* table = _table.load(std::memory_order_acquire);
+    if(!table)
+      return empty;
+    const std::atomic<int64_t>* block = table->blocks[day / block_size].load(std::memory_order_acquire);
+    return block ? block[day % block_size].load(std::memory_order_relaxed) : empty;
+  }
+
+  void set(int64_t day, int64_t value) {
+    if(day < 0 || day >= days)
+      return;
+    block_table* table = _table.load(std::memory_order_acquire);
+    if(!table) {
+      block_table* fresh = new block_table;
+      if(_table.compare_exchange_strong(table, fresh, std::memory_order_acq_rel))
+        table = fresh;
+      else
+        delete fresh;
+    }
+    std::atomic<int64_t>* block = table->blocks[day / block_size].load(std::memory_order_acquire);
+    if(!block) {
+      std::atomic<int64_t>* fresh = new std::atomic<int64_t>[block_size];
+      for(int64_t i=0; i<block_size; ++i)
+        fresh[i].store(empty, std::memory_order_relaxed);
+      if(table->blocks[day / block_size].compare_exchange_strong(block, fresh, std::memory_order_acq_rel))
+        block = fresh;
+      else
+        delete[] fresh;
+    }
+    block[day % block_size].store(value, std::memory_order_relaxed);
+  }
+
+  //! Bytes of the table and of the blocks filled so far
+  std::size_t memory_usage() const {
+    const block_table* table = _table.load(std::memory_order_acquire);
+    if(!table)
+      return 0;
+    std::size_t bytes = sizeof(block_table);
+    for(std::size_t i=0; i<block_count; ++i)
+      if(table->blocks[i].load(std::memory_order_acquire))
+        bytes += block_size * sizeof(std::atomic<int64_t>);
+    return bytes;
+  }
+
+  //! Drop every value, not to be called while other threads use the cache
+  void clear() {
+    block_table* table = _table.exchange(nullptr);
+    if(!table)
+      return;
+    for(std::size_t i=0; i<block_count; ++i)
+      delete[] table->blocks[i].load(std::memory_order_relaxed);
+    delete table;
+  }
+
+private:
+  static const std::size_t block_count = (days + block_size - 1) / block_size;
+
+  struct block_table {
+    block_table() {
+      for(std::size_t i=0; i<block_count; ++i)
+        blocks[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    std::atomic<std::atomic<int64_t>*>  blocks[block_count];
+  };
+
+  std::atomic<block_table*>  _table;    //!< null until the first value is set
+};
+
+#ifdef LOCAL_TIME_STATISTICS
+//! Relaxed atomic counter that can be copied along with its owner
+struct stat_counter : public std::atomic<uint64_t> {
+  using std::atomic<uint64_t>::operator=;
+  stat_counter() : std::atomic<uint64_t>(0) { }
+  stat_counter(const stat_counter& other) : std::atomic<uint64_t>(other.get()) { }
+  stat_counter& operator=(const stat_counter& other) { store(other.get(), std::memory_order_relaxed); return *this; }
+  uint64_t get() const { return load(std::memory_order_relaxed); }
+};
+
+//! Measures the time spent in a scope
+class stopwatch {
+public:
+  stopwatch() : _start(std::chrono::steady_clock::now()) { }
+  uint64_t elapsed_microseconds() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start).count();
+  }
+private:
+  std::chrono::steady_clock::time_point _start;
+};
+#endif //LOCAL_TIME_STATISTICS
+
 }
   
   
@@ -91,6 +500,44 @@ struct time_zone_entry_info {
 };
 
 
+#ifdef LOCAL_TIME_STATISTICS
+//! Snapshot of the counters of a time zone, indexed by time_zone::automatic_conversion where relevant
+struct time_zone_statistics {
+  uint64_t    utc_lookups;          //!< lookups of the segment containing a UTC time
+  uint64_t    local_lookups;        //!< lookups of the segment containing a local time
+  uint64_t    ambiguous[3];         //!< local times falling in two segments, by conversion policy
+  uint64_t    invalid[3];           //!< local times falling in no segment, by conversion policy
+  uint64_t    load_microseconds;    //!< time spent reading the zone from its zoneinfo file
+};
+
+//! Snapshot of the counters of a time zone database
+struct time_zone_database_statistics {
+  uint64_t    lookup_hits;          //!< time_zone_from_region calls that found the region
+  uint64_t    lookup_misses;        //!< time_zone_from_region calls that did not
+  uint64_t    loads;                //!< successful load_from_file/load_from_struct calls
+  uint64_t    last_load_microseconds;
+  uint64_t    total_load_microseconds;
+};
+#endif //LOCAL_TIME_STATISTICS
+
+
+//! Outcome of mapping a local time onto the segments of a time zone
+enum local_time_status { LOCAL_TIME_VALID, LOCAL_TIME_AMBIGUOUS, LOCAL_TIME_INVALID };
+
+struct local_time_lookup {
+  explicit local_time_lookup(const time_zone_entry_info* z) : status(LOCAL_TIME_VALID), first(z), second(nullptr) { }
+  local_time_lookup(local_time_status st, const time_zone_entry_info* z1, const time_zone_entry_info* z2) : status(st), first(z1), second(z2) { }
+
+  local_time_status             status;     //!< whether the local time maps to exactly one segment
+  const time_zone_entry_info*   first;      //!< the matching segment, or the earlier of two candidates
+  const time_zone_entry_info*   second;     //!< the later candidate of an ambiguous or invalid local time
+};
+
+
+//! Resolutions of the int64 timestamps, counted from 1970-01-01 00:00:00, taken by the integer lookups of time_zone
+struct microsecond_resolution { static const int64_t ticks_per_microsecond = 1; };
+struct nanosecond_resolution  { static const int64_t ticks_per_microsecond = 1000; };
+
 class time_zone;
 typedef std::shared_ptr<time_zone>       time_zone_ptr;
 typedef std::shared_ptr<const time_zone> time_zone_const_ptr  ;
@@ -100,154 +547,546 @@ class time_zone {
 public:
 
   enum automatic_conversion { ASSUME_DST, ASSUME_NON_DST, THROW_ON_AMBIGUOUS };
+
+  //! Shape of the zone, decided whenever its entries change and used to pick the lookup path
+  enum zone_kind { EMPTY_ZONE, FIXED_OFFSET_ZONE, VARIABLE_OFFSET_ZONE };
+
+  typedef detail::arena_allocator<std::pair<const ptime, time_zone_entry_info> >        allocator_type;
+  typedef std::map<ptime, time_zone_entry_info, std::less<ptime>, allocator_type>       data_type;
   
   const std::string& name() const { return _name; }
 
-  time_zone(const std::string& name) : _name(name) { }
+  time_zone(const std::string& name, const allocator_type& alloc = allocator_type()) : _name(name), _data(alloc), _index(alloc) { }
+
+  allocator_type get_allocator() const { return _data.get_allocator(); }
+
+  zone_kind kind() const { return _index.kind; }
+
+  //! Local time of a UTC time, both as integers of the given resolution
+  template<class Resolution = microsecond_resolution>
+  int64_t to_local(int64_t utc) const {
+    LOCAL_TIME_STAT_INC(_stats.utc_lookups);
+    std::size_t cursor = 0;
+    return utc - utc_offset<Resolution>(utc, cursor);
+  }
+
+  //! Entry in effect at a UTC time given as an integer of the resolution, nullptr for a zone without entries
+  template<class Resolution = microsecond_resolution>
+  const time_zone_entry_info* entry_from_utc(int64_t utc) const {
+    LOCAL_TIME_STAT_INC(_stats.utc_lookups);
+    if(_index.kind == EMPTY_ZONE)
+      return nullptr;
+    std::size_t cursor = 0;
+    utc_offset<Resolution>(utc, cursor);
+    return _index.kind == FIXED_OFFSET_ZONE ? &_index.types[0] : segment_info(cursor);
+  }
+
+  //! UTC time of a local time, both as integers of the given resolution; throws like local_date_time on ambiguous or invalid times
+  template<class Resolution = microsecond_resolution>
+  int64_t to_utc(int64_t local, automatic_conversion dst = THROW_ON_AMBIGUOUS) const {
+    LOCAL_TIME_STAT_INC(_stats.local_lookups);
+    std::size_t cursor = 0;
+    return local + local_offset<Resolution>(local, cursor, dst);
+  }
+
+  //! Convert count local times of zone from, as integers of the given resolution, to local times of zone to.
+  //! Both lookups are done in one pass and each keeps its segment from the previous value, so sorted input
+  //! walks the two transition tables in lockstep. Throws like local_date_time on ambiguous or invalid times.
+  template<class Resolution = microsecond_resolution>
+  static void rezone(const time_zone& from, const time_zone& to, const int64_t* local, std::size_t count, int64_t* out, automatic_conversion dst = THROW_ON_AMBIGUOUS) {
+    #ifdef LOCAL_TIME_STATISTICS
+    from._stats.local_lookups.fetch_add(count, std::memory_order_relaxed);
+    to._stats.utc_lookups.fetch_add(count, std::memory_order_relaxed);
+    #endif
+    if(from._index.kind != VARIABLE_OFFSET_ZONE && to._index.kind != VARIABLE_OFFSET_ZONE) {
+      std::size_t cursor = 0;
+      int64_t shift = from.local_offset<Resolution>(0, cursor, dst) - to.utc_offset<Resolution>(0, cursor);
+      for(std::size_t i=0; i<count; ++i)
+        out[i] = local[i] + shift;
+      return;
+    }
+    std::size_t from_cursor = 0, to_cursor = 0;
+    for(std::size_t i=0; i<count; ++i) {
+      int64_t utc = local[i] + from.local_offset<Resolution>(local[i], from_cursor, dst);
+      out[i] = utc - to.utc_offset<Resolution>(utc, to_cursor);
+    }
+  }
+
+  //! Local calendar day, in days since 1970-01-01, of count UTC times given as integers of the resolution.
+  //! When starts is given it receives the UTC start of each day: the first instant whose local time is on that day.
+  template<class Resolution = microsecond_resolution>
+  void local_days(const int64_t* utc, std::size_t count, int32_t* days, int64_t* starts = nullptr) const {
+    local_buckets<detail::microseconds_per_day, Resolution>(utc, count, days, starts);
+  }
+
+  //! UTC start of the local day of a UTC time: its local midnight, or the first instant of the day when midnight
+  //! is skipped; days may last 23 or 25 hours. Special values are returned unchanged.
+  ptime local_day_start(const ptime& utc) const {
+    if(utc.is_special())
+      return utc;
+    std::size_t cursor = 0;
+    int64_t t = detail::ptime_to_microseconds(utc);
+    return detail::microseconds_to_ptime(day_start(detail::floor_div<detail::microseconds_per_day>(t - utc_offset<microsecond_resolution>(t, cursor))));
+  }
+
+  //! UTC start of the local day following the one of a UTC time, so that the day is [local_day_start, local_day_end)
+  ptime local_day_end(const ptime& utc) const {
+    if(utc.is_special())
+      return utc;
+    std::size_t cursor = 0;
+    int64_t t = detail::ptime_to_microseconds(utc);
+    return detail::microseconds_to_ptime(day_start(detail::floor_div<detail::microseconds_per_day>(t - utc_offset<microsecond_resolution>(t, cursor)) + 1));
+  }
+
+  //! Local hour, in hours since 1970-01-01 00:00 local time, of count UTC times; starts as for local_days
+  template<class Resolution = microsecond_resolution>
+  void local_hours(const int64_t* utc, std::size_t count, int64_t* hours, int64_t* starts = nullptr) const {
+    local_buckets<detail::microseconds_per_hour, Resolution>(utc, count, hours, starts);
+  }
+
+  //! Convert a range of local times of zone from to local times of zone to, special values being kept as they are
+  template<class InputIterator, class OutputIterator>
+  static OutputIterator rezone(const time_zone& from, const time_zone& to, InputIterator first, InputIterator last, OutputIterator out, automatic_conversion dst = THROW_ON_AMBIGUOUS) {
+    std::size_t from_cursor = 0, to_cursor = 0;
+    for(; first!=last; ++first, ++out) {
+      const ptime& p = *first;
+      if(p.is_special()) {
+        *out = p;
+        continue;
+      }
+      int64_t t = detail::ptime_to_microseconds(p);
+      int64_t utc = t + from.local_offset<microsecond_resolution>(t, from_cursor, dst);
+      *out = detail::microseconds_to_ptime(utc - to.utc_offset<microsecond_resolution>(utc, to_cursor));
+    }
+    return out;
+  }
   
   void add_entry(int64_t microsecs, time_zone_entry_info&& tze) {
-    if(!_data.insert(std::make_pair(detail::microseconds_to_ptime(microsecs), std::move(tze))).second)
-      throw local_time_exception("Failed adding entry to the time zone.");
+    if(_data.empty())
+      index_entries(_data);
+    insert_entry(microsecs, std::move(tze));
+    build_index();
   }
 
   void remove_entry(int64_t microsecs) {
+    if(_data.empty())
+      index_entries(_data);
     if(!_data.erase(detail::microseconds_to_ptime(microsecs)))
       throw local_time_exception("Failed erasing the time zone entry.");
+    build_index();
   }
   
+  #ifdef LOCAL_TIME_STATISTICS
+  time_zone_statistics statistics() const {
+    time_zone_statistics st;
+    st.utc_lookups = _stats.utc_lookups.get();
+    st.local_lookups = _stats.local_lookups.get();
+    for(int i=0; i<3; ++i) {
+      st.ambiguous[i] = _stats.ambiguous[i].get();
+      st.invalid[i] = _stats.invalid[i].get();
+    }
+    st.load_microseconds = _stats.load_microseconds.get();
+    return st;
+  }
+
+  void reset_statistics() const {
+    _stats.utc_lookups = 0;
+    _stats.local_lookups = 0;
+    for(int i=0; i<3; ++i) {
+      _stats.ambiguous[i] = 0;
+      _stats.invalid[i] = 0;
+    }
+  }
+  #endif //LOCAL_TIME_STATISTICS
+
   static time_zone_ptr duplicate(time_zone_const_ptr p) {
     time_zone_ptr ptr(new time_zone(p->name()));
-    ptr->_data = p->_data;
+    p->index_entries(ptr->_data);
+    ptr->build_index();
     return ptr;
   }
+
+  //! Bytes used by the zone, estimated from the sizes of its containers: the object, its entries, its lookup tables
+  //! and the filled part of its day cache. Tables mapped from shared memory are not counted.
+  std::size_t memory_usage() const {
+    std::size_t bytes = sizeof(time_zone) + detail::heap_bytes(_name) + _day_starts.memory_usage();
+    bytes += _index.iso.capacity() * sizeof(detail::iso_offset);
+    for(auto it=_data.begin(); it!=_data.end(); ++it)
+      bytes += detail::tree_node_bytes<data_type::value_type>() + detail::heap_bytes(it->second.tz);
+    bytes += _index.types.capacity() * sizeof(time_zone_entry_info);
+    for(auto it=_index.types.begin(); it!=_index.types.end(); ++it)
+      bytes += detail::heap_bytes(it->tz);
+    bytes += (_index.utc_data.capacity() + _index.local_data.capacity() + _index.offset_data.capacity()) * sizeof(int64_t)
+           + (_index.type_data.capacity() + _index.utc_bucket_data.capacity() + _index.local_bucket_data.capacity()) * sizeof(uint16_t);
+    return bytes;
+  }
+
+  //! A copy of the zone in its most compact form: the lookup tables alone, sized to fit and on the global heap, with the
+  //! entries rebuilt from them if the copy is changed later. Given a cutoff year, the segments ending by January 1st of
+  //! that year are dropped and the segment in effect then also covers all earlier times.
+  time_zone_ptr compacted(int cutoff_year = 0) const {
+    std::size_t first = 0;
+    if(cutoff_year) {
+      int64_t cutoff = detail::ptime_to_microseconds(ptime(boost::gregorian::date(static_cast<unsigned short>(cutoff_year), 1, 1)));
+      while(first + 1 < _index.utc.size() && _index.utc[first + 1] <= cutoff)
+        ++first;
+    }
+    time_zone_ptr ptr(new time_zone(_name));
+    for(std::size_t i=first; i<_index.utc.size(); ++i)
+      ptr->_data.insert(ptr->_data.end(), std::make_pair(detail::microseconds_to_ptime(_index.utc[i]), *segment_info(i)));
+    ptr->build_index();
+    data_type(ptr->get_allocator()).swap(ptr->_data);
+    ptr->_index.types.shrink_to_fit();
+    ptr->_index.iso.shrink_to_fit();
+    return ptr;
+  }
+
+  //! Longest string utc_to_local_iso_string writes into a buffer
+  static const std::size_t max_iso_string_size = detail::max_iso_string_size + detail::iso_offset::capacity;
+
+  //! Write the local time of p and its offset from UTC at out, in the basic or extended ISO 8601 form, returning the end;
+  //! out must hold max_iso_string_size characters. Nothing is allocated, the offset being copied from the suffixes of the entry.
+  char* utc_to_local_iso_string(const ptime& p, char* out, bool extended = false) const {
+    const time_zone_entry_info* z = zone_info_from_utc(p);
+    if(!z)
+      return detail::write_iso_string(out, p, extended);
+    return _index.iso[z - _index.types.data()].write(detail::write_iso_string(out, p - z->offset, extended), extended);
+  }
   
   #ifdef USE_ZONEINFO
-  static time_zone from_zoneinfo(const std::string& name, const std::string& path=TZDIR) {
-    boost::filesystem::path file_path(path);
-    file_path /= name;
-
-    // read tzhead
-    std::ifstream ifs(file_path.string(), std::ios::binary);
-    if(!ifs.good())
-      throw std::runtime_error("Error opening zone file '" + file_path.string() + "'"); // LCOV_EXCL_LINE
-    ifs.seekg(0, std::ios::beg);
-
-    union th_union_t {
-      tzhead                head;
-      const char*           ptr;
-    };
-
-    #ifndef TYPE_SIGNED
-    #define TYPE_SIGNED(type) (((type) -1) < 0)
-    #endif /* !defined TYPE_SIGNED */
-
-    /* The minimum and maximum finite time values.  */
-    static time_t const time_t_min =
-      (TYPE_SIGNED(time_t)
-      ? (time_t) -1 << (CHAR_BIT * sizeof (time_t) - 1)
-      : 0);
-    static time_t const time_t_max =
-      (TYPE_SIGNED(time_t)
-      ? - (~ 0 < 0) - ((time_t) -1 << (CHAR_BIT * sizeof (time_t) - 1))
-      : -1);
-
-      std::string contents;
-    ifs.seekg(0, std::ios::end);
-    contents.resize(ifs.tellg());
-    ifs.seekg(0, std::ios::beg);
-    ifs.read(&contents[0], contents.size());
-    ifs.close();
-
-    const char* data = contents.c_str();
-    const th_union_t *th_union = reinterpret_cast<const th_union_t*>(data);
-    const tzhead* th = &th_union->head;
-
-    if(std::string(th->tzh_magic, 4) != TZ_MAGIC)
-      throw std::runtime_error("Invalid zone file '" + file_path.string() + "'"); // LCOV_EXCL_LINE
-
-    std::vector<time_t> transitions;
-    std::vector<std::tuple<int, bool, short>> types;
-    std::vector<unsigned char> transition_types;
-    const char* abbr;
-
-    for (int stored = 4; stored <= 8; stored *= 2) {
-      int ttisstdcnt = (int) detzcode(th->tzh_ttisstdcnt);
-      int ttisgmtcnt = (int) detzcode(th->tzh_ttisgmtcnt);
-      int leapcnt = (int) detzcode(th->tzh_leapcnt);
-      int timecnt = (int) detzcode(th->tzh_timecnt);
-      int typecnt = (int) detzcode(th->tzh_typecnt);
-      int charcnt = (int) detzcode(th->tzh_charcnt);
-
-      const char* ptr = th->tzh_charcnt + sizeof(th->tzh_charcnt);
-      if (leapcnt < 0 || leapcnt > TZ_MAX_LEAPS || typecnt <= 0 || typecnt > TZ_MAX_TYPES || timecnt < 0 || timecnt > TZ_MAX_TIMES || charcnt < 0 || charcnt > TZ_MAX_CHARS || (ttisstdcnt != typecnt && ttisstdcnt != 0) || (ttisgmtcnt != typecnt && ttisgmtcnt != 0))
-        throw std::runtime_error("Error reading zone file '" + file_path.string() + "' struct"); // LCOV_EXCL_LINE
-      if (contents.size() < (sizeof(tzhead)       /* struct tzhead */ + timecnt * stored   /* ats */ + timecnt        /* types */ + typecnt * 6        /* ttinfos */ + charcnt        /* chars */ + leapcnt * (stored + 4) /* lsinfos */ + ttisstdcnt     /* ttisstds */ + ttisgmtcnt))       /* ttisgmts */
-        throw std::runtime_error("Error reading zone file '" + file_path.string() + "' struct"); // LCOV_EXCL_LINE
-
-      transitions.reserve(timecnt);
-      transitions.resize(0);
-      for (int i = 0; i < timecnt; ++i) {
-          int_fast64_t at = stored == 4 ? detzcode(ptr) : detzcode64(ptr);
-          if(at <= time_t_max) {
-            transitions.push_back(((TYPE_SIGNED(time_t) ? at < time_t_min : at < 0) ? time_t_min : at));
-          }
-          ptr += stored;
+  //! Load a zone file; zones with leap seconds, such as the ones under right/, have their transitions moved to UTC
+  static inline time_zone from_zoneinfo(const std::string& name, const std::string& path=TZDIR);
+
+  //! Load the transitions of a zone file that the UTC times of [from, to] need, as time_zone_database::load_from_file does
+  static inline time_zone from_zoneinfo(const std::string& name, const std::string& path, const ptime& from, const ptime& to);
+
+  //! Write the zone to the TZif file path/name(), with a POSIX TZ footer keeping the last offset after the last transition
+  inline void to_zoneinfo(const std::string& path=TZDIR) const;
+
+  //! Write the zone to the TZif file path/name() with the given footer, which may be empty, as a version '2' or '3' file
+  inline void to_zoneinfo(const std::string& path, const std::string& footer, char version='2') const;
+
+  //! POSIX TZ string for the offset in effect after the last transition, empty if that segment is DST
+  std::string posix_footer() const {
+    if(_index.types.empty())
+      return std::string();
+    const time_zone_entry_info* last = segment_info(_index.utc.size() - 1);
+    if(last->dst)
+      return std::string();
+    std::string footer;
+    bool alpha = last->tz.size() >= 3;
+    for(auto it=last->tz.begin(); it!=last->tz.end(); ++it)
+      alpha = alpha && std::isalpha(static_cast<unsigned char>(*it));
+    footer = alpha ? last->tz : "<" + last->tz + ">";
+    int64_t seconds = last->offset.total_seconds();
+    if(seconds < 0) {
+      footer += '-';
+      seconds = -seconds;
+    }
+    detail::append_integer(footer, seconds / 3600);
+    if(seconds % 3600) {
+      footer += (seconds % 3600) / 60 < 10 ? ":0" : ":";
+      detail::append_integer(footer, (seconds % 3600) / 60);
+      if(seconds % 60) {
+        footer += seconds % 60 < 10 ? ":0" : ":";
+        detail::append_integer(footer, seconds % 60);
       }
+    }
+    return footer;
+  }
+  #endif //USE_ZONEINFO
+
+private:
+
+  template<class T> using vector_type = std::vector<T, detail::arena_allocator<T> >;
 
-      transition_types.reserve(timecnt);
-      transition_types.resize(0);
-      for(int i=0; i<timecnt; ++i) {
-          unsigned char typ = *ptr++;
-          if (typecnt <= typ)
-            throw std::runtime_error("Error reading zone file '" + file_path.string() + "' struct"); // LCOV_EXCL_LINE
-          transition_types.push_back(typ);
+  //! Flat copy of _data used for lookups: sorted transition times plus a bucket table over the common era.
+  //! The tables are views, either over the vectors below or over a shared memory segment kept alive by mapping.
+  struct segment_index {
+    explicit segment_index(const allocator_type& alloc) : kind(EMPTY_ZONE), local_tail(0), types(alloc), iso(alloc), utc_data(alloc), local_data(alloc), offset_data(alloc), type_data(alloc), utc_bucket_data(alloc), local_bucket_data(alloc) { }
+
+    segment_index(const segment_index& o) : kind(o.kind), local_tail(o.local_tail), types(o.types), iso(o.iso), mapping(o.mapping), utc_data(o.utc_data), local_data(o.local_data), offset_data(o.offset_data), type_data(o.type_data), utc_bucket_data(o.utc_bucket_data), local_bucket_data(o.local_bucket_data) {
+      bind(o);
+    }
+
+    segment_index(segment_index&& o) : kind(o.kind), local_tail(o.local_tail), types(std::move(o.types)), iso(std::move(o.iso)), mapping(std::move(o.mapping)), utc_data(std::move(o.utc_data)), local_data(std::move(o.local_data)), offset_data(std::move(o.offset_data)), type_data(std::move(o.type_data)), utc_bucket_data(std::move(o.utc_bucket_data)), local_bucket_data(std::move(o.local_bucket_data)) {
+      bind(o);
+    }
+
+    segment_index& operator=(const segment_index& o) {
+      if(this != &o) {
+        kind = o.kind; local_tail = o.local_tail; types = o.types; iso = o.iso; mapping = o.mapping;
+        utc_data = o.utc_data; local_data = o.local_data; offset_data = o.offset_data; type_data = o.type_data;
+        utc_bucket_data = o.utc_bucket_data; local_bucket_data = o.local_bucket_data;
+        bind(o);
       }
+      return *this;
+    }
 
-      types.reserve(typecnt);
-      for(int i = 0; i < typecnt; ++i) {
-          /* gmt offset */
-          int offset = detzcode(ptr);
-          ptr += 4;
-          /* dst */
-          if(!(*ptr < 2))
-            throw std::runtime_error("Error reading zone file '" + file_path.string() + "' struct"); // LCOV_EXCL_LINE
-          bool dst = *ptr;
-          ptr++;
-          /* abbr */
-          short abbrind = *ptr++;
-          if (! (abbrind < charcnt))
-            throw std::runtime_error("Error reading zone file '" + file_path.string() + "' struct"); // LCOV_EXCL_LINE
-          types.push_back(std::make_tuple(-offset, dst, abbrind));
+    //! Format the ISO 8601 offset suffixes of the entries, once they are all in types
+    void format_offsets() {
+      iso.clear();
+      iso.reserve(types.size());
+      for(auto it=types.begin(); it!=types.end(); ++it)
+        iso.push_back(detail::iso_offset(it->offset.total_seconds()));
+    }
+
+    //! Point the tables at the owned vectors, or at the same shared memory as o
+    void bind(const segment_index& o) {
+      if(mapping) {
+        utc = o.utc; local = o.local; offset = o.offset; type = o.type;
+        utc_bucket = o.utc_bucket; local_bucket = o.local_bucket;
+        return;
       }
+      utc = detail::table_view<int64_t>(utc_data.data(), utc_data.size());
+      local = detail::table_view<int64_t>(local_data.data(), local_data.size());
+      offset = detail::table_view<int64_t>(offset_data.data(), offset_data.size());
+      type = detail::table_view<uint16_t>(type_data.data(), type_data.size());
+      utc_bucket = detail::table_view<uint16_t>(utc_bucket_data.data(), utc_bucket_data.size());
+      local_bucket = detail::table_view<uint16_t>(local_bucket_data.data(), local_bucket_data.size());
+    }
 
-      abbr = ptr;
-      ptr += charcnt;
-      ptr += leapcnt * 2 * stored;
-      ptr += typecnt; // tt_ttisstd
-      ptr += typecnt; // tt_ttisgmt
+    zone_kind                           kind;           //!< lookup path of the zone
+    int64_t                             local_tail;     //!< local times from here on map to the last segment only
 
-      if (th->tzh_version[0] == '\0')
-          break; // LCOV_EXCL_LINE
+    detail::table_view<int64_t>         utc;            //!< transition times, microseconds since the epoch
+    detail::table_view<int64_t>         local;          //!< local time at which each segment starts
+    detail::table_view<int64_t>         offset;         //!< offset of each segment, in microseconds
+    detail::table_view<uint16_t>        type;           //!< entry of each segment in types
+    vector_type<time_zone_entry_info>   types;          //!< distinct entries of the zone
+    vector_type<detail::iso_offset>     iso;            //!< offset suffixes of ISO 8601 local times, by entry of types
+    detail::table_view<uint16_t>        utc_bucket;     //!< segment in effect at the start of each UTC bucket
+    detail::table_view<uint16_t>        local_bucket;   //!< segment in effect at the start of each local bucket
 
-      // get ready for 8 bytes
-      th_union = reinterpret_cast<const th_union_t*>(ptr);
-      th = &th_union->head;
+    std::shared_ptr<const char>         mapping;        //!< shared memory holding the tables, null when they are owned
+    vector_type<int64_t>                utc_data;
+    vector_type<int64_t>                local_data;
+    vector_type<int64_t>                offset_data;
+    vector_type<uint16_t>               type_data;
+    vector_type<uint16_t>               utc_bucket_data;
+    vector_type<uint16_t>               local_bucket_data;
+  };
+
+  std::string                            _name;         //!< time zone name
+  data_type                              _data;         //!< contains the discontinuity points for the time zone
+  segment_index                          _index;        //!< lookup tables built from _data
+  #ifdef LOCAL_TIME_STATISTICS
+  struct counters {
+    detail::stat_counter  utc_lookups;
+    detail::stat_counter  local_lookups;
+    detail::stat_counter  ambiguous[3];
+    detail::stat_counter  invalid[3];
+    detail::stat_counter  load_microseconds;
+  };
+  mutable counters                       _stats;        //!< usage counters
+  #endif
+  mutable detail::day_cache              _day_starts;   //!< UTC start of each local day, filled on demand
+
+  void insert_entry(int64_t microsecs, time_zone_entry_info&& tze) {
+    if(!_data.insert(std::make_pair(detail::microseconds_to_ptime(microsecs), std::move(tze))).second)
+      throw local_time_exception("Failed adding entry to the time zone.");
+  }
+
+  //! Drop the entries that no UTC time of [from, to] needs, before build_index
+  void restrict_entries(const ptime& from, const ptime& to) {
+    auto bounds = detail::window_bounds(_data.begin(), _data.end(), from, to, [](const data_type::value_type& v) -> const ptime& { return v.first; });
+    _data.erase(bounds.second, _data.end());
+    _data.erase(_data.begin(), bounds.first);
+  }
+
+  //! Rebuild the lookup tables, to be called whenever _data changes
+  void build_index() {
+    std::size_t n = _data.size();
+    if(n > std::numeric_limits<uint16_t>::max())
+      throw local_time_exception("Too many entries in the time zone.");
+    _index.mapping.reset();
+    _index.utc_data.clear(); _index.utc_data.reserve(n);
+    _index.local_data.clear(); _index.local_data.reserve(n);
+    _index.offset_data.clear(); _index.offset_data.reserve(n);
+    _index.type_data.clear(); _index.type_data.reserve(n);
+    _index.utc_bucket_data.clear();
+    _index.local_bucket_data.clear();
+
+    std::vector<const time_zone_entry_info*> distinct;
+    for(auto it=_data.begin(); it!=_data.end(); ++it) {
+      std::size_t t = 0;
+      while(t < distinct.size() && !(distinct[t]->offset == it->second.offset && distinct[t]->dst == it->second.dst && distinct[t]->tz == it->second.tz))
+        ++t;
+      if(t == distinct.size())
+        distinct.push_back(&it->second);
+      int64_t utc = detail::ptime_to_microseconds(it->first);
+      int64_t offset = it->second.offset.total_microseconds();
+      _index.utc_data.push_back(utc);
+      _index.local_data.push_back(utc - offset);
+      _index.offset_data.push_back(offset);
+      _index.type_data.push_back(static_cast<uint16_t>(t));
     }
+    _index.types.clear();
+    _index.types.reserve(distinct.size());
+    for(auto it=distinct.begin(); it!=distinct.end(); ++it)
+      _index.types.push_back(**it);
+    _index.format_offsets();
 
-    time_zone this_tz(name);
-    for(std::size_t i=0; i<transitions.size(); ++i) {
-      this_tz.add_entry(transitions[i] * 1000000, time_zone_entry_info(std::get<0>(types[transition_types[i]]), std::string(abbr + std::get<2>(types[transition_types[i]])), std::get<1>(types[transition_types[i]])));
+    _index.kind = n == 0 ? EMPTY_ZONE : (distinct.size() == 1 ? FIXED_OFFSET_ZONE : VARIABLE_OFFSET_ZONE);
+    _day_starts.clear();
+    if(_index.kind == VARIABLE_OFFSET_ZONE) {
+      _index.local_tail = std::max(_index.local_data[n - 1], _index.utc_data[n - 1] - _index.offset_data[n - 2]);
+      _index.utc_bucket_data.resize(detail::index_bucket_count);
+      _index.local_bucket_data.resize(detail::index_bucket_count);
+      std::size_t u = 0, l = 0;
+      for(int64_t b=0; b<detail::index_bucket_count; ++b) {
+        int64_t start = b << detail::index_bucket_shift;
+        while(u + 1 < n && _index.utc_data[u + 1] <= start)
+          ++u;
+        while(l + 1 < n && _index.local_data[l + 1] <= start)
+          ++l;
+        _index.utc_bucket_data[b] = static_cast<uint16_t>(u);
+        _index.local_bucket_data[b] = static_cast<uint16_t>(l);
+      }
     }
+    _index.bind(_index);
+  }
 
-    return this_tz;
-    #undef TYPE_SIGNED
+  //! Entries of the zone rebuilt from the lookup tables, for zones viewing shared memory whose _data is empty
+  void index_entries(data_type& out) const {
+    for(std::size_t i=0; i<_index.utc.size(); ++i)
+      out.insert(out.end(), std::make_pair(detail::microseconds_to_ptime(_index.utc[i]), *segment_info(i)));
   }
-  #endif //USE_ZONEINFO
 
-private:
+  //! Position of the last entry of a sorted table of microseconds not after t, 0 if there is none, t being in ticks of
+  //! Ticks per microsecond. Entries are scaled up to ticks to be compared, and finer ticks are shifted down to a bucket
+  //! no later than the time's own, so neither the bucket nor the scan forward from it divides.
+  template<int64_t Ticks = 1>
+  static std::size_t segment_at(const detail::table_view<int64_t>& table, const detail::table_view<uint16_t>& buckets, int64_t t) {
+    std::size_t i;
+    const int shift = detail::index_bucket_shift + detail::ceil_log2<Ticks>::value;
+    if(t >= 0 && (t >> shift) < detail::index_bucket_count) {
+      i = buckets[t >> shift];
+      while(i + 1 < table.size() && detail::reached<Ticks>(table[i + 1], t))
+        ++i;
+    }
+    else {
+      i = std::upper_bound(table.begin(), table.end(), t, [](int64_t v, int64_t start) { return !detail::reached<Ticks>(start, v); }) - table.begin();
+      if(i)
+        --i;
+    }
+    return i;
+  }
 
-  std::string                            _name;         //!< time zone name
-  std::map<ptime, time_zone_entry_info>  _data;         //!< contains the discontinuity points for the time zone
+  //! segment_at for inputs in increasing order: the segment found last time or the next one are tried first
+  template<int64_t Ticks = 1>
+  static std::size_t seek_segment(const detail::table_view<int64_t>& table, const detail::table_view<uint16_t>& buckets, int64_t t, std::size_t cursor) {
+    if(detail::reached<Ticks>(table[cursor], t)) {
+      if(cursor + 1 == table.size() || !detail::reached<Ticks>(table[cursor + 1], t))
+        return cursor;
+      if(cursor + 2 == table.size() || !detail::reached<Ticks>(table[cursor + 2], t))
+        return cursor + 1;
+    }
+    return segment_at<Ticks>(table, buckets, t);
+  }
+
+  const time_zone_entry_info* segment_info(std::size_t i) const { return &_index.types[_index.type[i]]; }
+
+  //! Local buckets of Width microseconds for a UTC column; zones without transitions reduce to a loop the compiler vectorizes
+  template<int64_t Width, class Resolution, class T>
+  void local_buckets(const int64_t* utc, std::size_t count, T* out, int64_t* starts) const {
+    #ifdef LOCAL_TIME_STATISTICS
+    _stats.utc_lookups.fetch_add(count, std::memory_order_relaxed);
+    #endif
+    const int64_t ticks = Resolution::ticks_per_microsecond;
+    if(_index.kind != VARIABLE_OFFSET_ZONE) {
+      std::size_t cursor = 0;
+      int64_t offset = utc_offset<Resolution>(0, cursor);
+      for(std::size_t i=0; i<count; ++i)
+        out[i] = static_cast<T>(detail::floor_div<Width * Resolution::ticks_per_microsecond>(utc[i] - offset));
+      if(starts)
+        for(std::size_t i=0; i<count; ++i)
+          starts[i] = static_cast<int64_t>(out[i]) * Width * ticks + offset;
+      return;
+    }
+    std::size_t cursor = 0;
+    int64_t last_bucket = 0, last_start = 0;
+    bool cached = false;
+    for(std::size_t i=0; i<count; ++i) {
+      int64_t offset = utc_offset<Resolution>(utc[i], cursor);
+      int64_t bucket = detail::floor_div<Width * Resolution::ticks_per_microsecond>(utc[i] - offset);
+      out[i] = static_cast<T>(bucket);
+      if(!starts)
+        continue;
+      if(!cached || bucket != last_bucket) {
+        last_bucket = bucket;
+        last_start = local_start_utc(bucket * Width, cursor) * ticks;
+        cached = true;
+      }
+      starts[i] = last_start;
+    }
+  }
+
+  //! First UTC instant of a local day, given in days since the epoch, cached for variable offset zones
+  int64_t day_start(int64_t day) const {
+    int64_t midnight = day * detail::microseconds_per_day;
+    if(_index.kind != VARIABLE_OFFSET_ZONE)
+      return midnight + (_index.kind == EMPTY_ZONE ? 0 : _index.offset[0]);
+    int64_t start = _day_starts.get(day);
+    if(start != detail::day_cache::empty)
+      return start;
+    std::size_t cursor = 0;
+    local_time_lookup r = lookup_local<1, false>(midnight, cursor, THROW_ON_AMBIGUOUS);
+    switch(r.status) {
+      case LOCAL_TIME_VALID:
+      case LOCAL_TIME_AMBIGUOUS: // the earlier of the two midnights
+        start = midnight + r.first->offset.total_microseconds();
+        break;
+      case LOCAL_TIME_INVALID:  // midnight is skipped, the day starts with the transition
+        start = _index.utc[cursor + 1];
+        break;
+    }
+    _day_starts.set(day, start);
+    return start;
+  }
+
+  //! First UTC instant whose local time is not before local, searching back from the segment of a later instant
+  int64_t local_start_utc(int64_t local, std::size_t segment) const {
+    // the first segment extends back forever
+    int64_t start = segment ? std::max(_index.utc[segment], local + _index.offset[segment]) : local + _index.offset[0];
+    while(segment > 0) {
+      --segment;
+      int64_t candidate = segment ? std::max(_index.utc[segment], local + _index.offset[segment]) : local + _index.offset[0];
+      if(candidate >= _index.utc[segment + 1])
+        break;
+      start = candidate;
+    }
+    return start;
+  }
+
+  //! Offset, in ticks of the resolution, to add to a local time of the zone to get UTC, throwing on ambiguous or invalid times.
+  //! Transitions fall on whole microseconds and are scaled up to the time's ticks to be compared, so no lookup divides.
+  template<class Resolution>
+  int64_t local_offset(int64_t t, std::size_t& cursor, automatic_conversion dst) const {
+    if(_index.kind != VARIABLE_OFFSET_ZONE)
+      return _index.kind == EMPTY_ZONE ? 0 : _index.offset[0] * Resolution::ticks_per_microsecond;
+    local_time_lookup r = lookup_local<Resolution::ticks_per_microsecond>(t, cursor, dst);
+    switch(r.status) {
+      case LOCAL_TIME_VALID:
+        break;
+      case LOCAL_TIME_AMBIGUOUS:
+        throw ambiguous_result(_name, detail::to_iso_string(detail::microseconds_to_ptime(detail::floor_div<Resolution::ticks_per_microsecond>(t))));
+      case LOCAL_TIME_INVALID:
+        throw time_label_invalid(_name, detail::to_iso_string(detail::microseconds_to_ptime(detail::floor_div<Resolution::ticks_per_microsecond>(t))));
+    }
+    return r.first->offset.total_microseconds() * Resolution::ticks_per_microsecond;
+  }
+
+  //! Offset, in ticks of the resolution, to subtract from a UTC time to get the local time of the zone
+  template<class Resolution>
+  int64_t utc_offset(int64_t t, std::size_t& cursor) const {
+    if(_index.kind != VARIABLE_OFFSET_ZONE)
+      return (_index.kind == EMPTY_ZONE ? 0 : _index.offset[0]) * Resolution::ticks_per_microsecond;
+    const int64_t ticks = Resolution::ticks_per_microsecond;
+    std::size_t n = _index.utc.size();
+    cursor = detail::reached<ticks>(_index.utc[n - 1], t) ? n - 1 : seek_segment<ticks>(_index.utc, _index.utc_bucket, t, cursor);
+    return _index.offset[cursor] * Resolution::ticks_per_microsecond;
+  }
   
   ptime utc_to_local(const ptime& p) const {
     const time_zone_entry_info* z = zone_info_from_utc(p);
@@ -266,108 +1105,141 @@ private:
   }
   
   const time_zone_entry_info* zone_info_from_utc(const ptime& p) const {
-    if(!_data.size())
-      return nullptr;
-    auto match = _data.lower_bound(p);
-    if(match->first != p)
-    match--;
-    return &match->second;
+    LOCAL_TIME_STAT_INC(_stats.utc_lookups);
+    switch(_index.kind) {
+      case EMPTY_ZONE:
+        return nullptr;
+      case FIXED_OFFSET_ZONE:
+        return &_index.types[0];
+      case VARIABLE_OFFSET_ZONE:
+        break;
+    }
+    std::size_t n = _index.utc.size();
+    if(p.is_special())
+      return segment_info(p.is_neg_infinity() ? 0 : n - 1);
+    int64_t t = detail::ptime_to_microseconds(p);
+    if(t >= _index.utc[n - 1]) // the last offset holds forever
+      return segment_info(n - 1);
+    return segment_info(segment_at(_index.utc, _index.utc_bucket, t));
   }
   
   const time_zone_entry_info* zone_info_from_local(const ptime& loc, automatic_conversion dst = THROW_ON_AMBIGUOUS) const {
-    switch(_data.size()){
-      case 0:
-        return nullptr;
-      case 1:
-        return &(_data.begin()->second);
+    local_time_lookup r = lookup_local(loc, dst);
+    switch(r.status) {
+      case LOCAL_TIME_VALID:
+        break;
+      case LOCAL_TIME_AMBIGUOUS:
+        throw ambiguous_result(_name, detail::to_iso_string(loc));
+      case LOCAL_TIME_INVALID:
+        throw time_label_invalid(_name, detail::to_iso_string(loc));
+    }
+    return r.first;
+  }
+
+  //! Non-throwing local time lookup: unresolved ambiguous or invalid times report both candidate segments
+  local_time_lookup lookup_local(const ptime& loc, automatic_conversion dst = THROW_ON_AMBIGUOUS) const {
+    LOCAL_TIME_STAT_INC(_stats.local_lookups);
+    switch(_index.kind) {
+      case EMPTY_ZONE:
+        return local_time_lookup(nullptr);
+      case FIXED_OFFSET_ZONE:
+        return local_time_lookup(&_index.types[0]);
+      case VARIABLE_OFFSET_ZONE:
+        break;
     }
+    std::size_t n = _index.utc.size();
+    if(loc.is_special())
+      return local_time_lookup(segment_info(loc.is_neg_infinity() ? 0 : n - 1));
+
+    std::size_t cursor = 0;
+    return lookup_local(detail::ptime_to_microseconds(loc), cursor, dst);
+  }
 
-    auto segment = std::upper_bound(_data.begin(), _data.end(), loc, [](const ptime& p, const std::pair<ptime, time_zone_entry_info>& r){ return p < r.first - r.second.offset; });
-    if(segment == _data.begin())
-      return &segment->second;
-    auto next_segment(segment); --segment; 
-    // segment is now the first element such that: time - offset <= loc
+  //! Local time lookup in a variable offset zone, in ticks of Ticks per microsecond, starting the search from the segment found last time.
+  //! Internal lookups leave the ambiguous and invalid counters, which count the times of the users, alone.
+  template<int64_t Ticks = 1, bool Counted = true>
+  local_time_lookup lookup_local(int64_t t, std::size_t& cursor, automatic_conversion dst) const {
+    std::size_t n = _index.utc.size();
+    if(detail::reached<Ticks>(_index.local_tail, t))
+      return local_time_lookup(segment_info(cursor = n - 1));
+    std::size_t segment = cursor = seek_segment<Ticks>(_index.local, _index.local_bucket, t, cursor);
+    if(segment == 0 && !detail::reached<Ticks>(_index.local[0], t))
+      return local_time_lookup(segment_info(0));
+    // segment is now the last one such that: time - offset <= loc
 
     // check the left side
-    if(segment != _data.begin()) {
-      auto prev_segment(segment); --prev_segment;
-      if(segment->first - prev_segment->second.offset > loc) { // in previous segment too
-        switch(dst) {
-          case ASSUME_DST:
-            if(segment->second.dst && !prev_segment->second.dst)
-              return &segment->second;
-            if (!segment->second.dst && prev_segment->second.dst)
-              return &prev_segment->second;
-            break;
-          case ASSUME_NON_DST:
-            if(segment->second.dst && !prev_segment->second.dst)
-              return &prev_segment->second;
-            if (!segment->second.dst && prev_segment->second.dst)
-              return &segment->second;
-            break;
-          case THROW_ON_AMBIGUOUS:
-            break;
-        }
-        throw ambiguous_result(_name, boost::posix_time::to_iso_string(loc));
+    if(segment != 0) {
+      std::size_t prev_segment = segment - 1;
+      if(!detail::reached<Ticks>(_index.utc[segment] - _index.offset[prev_segment], t)) { // in previous segment too
+        if(Counted)
+          LOCAL_TIME_STAT_INC(_stats.ambiguous[dst]);
+        const time_zone_entry_info* z = resolve(dst, segment_info(prev_segment), segment_info(segment));
+        if(z)
+          return local_time_lookup(z);
+        return local_time_lookup(LOCAL_TIME_AMBIGUOUS, segment_info(prev_segment), segment_info(segment));
       }
     }
     
     // check the right side
-    if( next_segment != _data.end()) {
-      if(next_segment->first - segment->second.offset <= loc) { // also in the next segment
-        switch(dst) {
-          case ASSUME_DST:
-            if(segment->second.dst && !next_segment->second.dst)
-              return &segment->second;
-            if (!segment->second.dst && next_segment->second.dst)
-              return &next_segment->second;
-            break;
-          case ASSUME_NON_DST:
-            if(segment->second.dst && !next_segment->second.dst)
-              return &next_segment->second;
-            if (!segment->second.dst && next_segment->second.dst)
-              return &segment->second;
-            break;
-          case THROW_ON_AMBIGUOUS:
-            break;
-        }
-        throw time_label_invalid(_name, boost::posix_time::to_iso_string(loc));
+    std::size_t next_segment = segment + 1;
+    if(next_segment != n) {
+      if(detail::reached<Ticks>(_index.utc[next_segment] - _index.offset[segment], t)) { // also in the next segment
+        if(Counted)
+          LOCAL_TIME_STAT_INC(_stats.invalid[dst]);
+        const time_zone_entry_info* z = resolve(dst, segment_info(segment), segment_info(next_segment));
+        if(z)
+          return local_time_lookup(z);
+        return local_time_lookup(LOCAL_TIME_INVALID, segment_info(segment), segment_info(next_segment));
       }
     }
 
-    return &segment->second;
+    return local_time_lookup(segment_info(segment));
+  }
+
+  //! Pick one of two consecutive segments according to the conversion policy, nullptr if it cannot decide
+  static const time_zone_entry_info* resolve(automatic_conversion dst, const time_zone_entry_info* first, const time_zone_entry_info* second) {
+    switch(dst) {
+      case ASSUME_DST:
+        if(second->dst && !first->dst)
+          return second;
+        if (!second->dst && first->dst)
+          return first;
+        break;
+      case ASSUME_NON_DST:
+        if(second->dst && !first->dst)
+          return first;
+        if (!second->dst && first->dst)
+          return second;
+        break;
+      case THROW_ON_AMBIGUOUS:
+        break;
+    }
+    return nullptr;
   }
   
   std::string utc_to_local_string(const ptime& p) const {
     const time_zone_entry_info* z = zone_info_from_utc(p);
     if(z != nullptr)
-      return boost::posix_time::to_iso_string(p - z->offset) + " " + z->tz;
+      return detail::to_iso_string(p - z->offset) + " " + z->tz;
     else
-      return boost::posix_time::to_iso_string(p);       // LCOV_EXCL_LINE
+      return detail::to_iso_string(p);       // LCOV_EXCL_LINE
   }
   
   std::string utc_to_local_iso_string(const ptime& p) const {
-    const time_zone_entry_info* z = zone_info_from_utc(p);
-    if(!z)
-      return boost::posix_time::to_iso_string(p);
-    std::ostringstream ss;
-    ss << boost::posix_time::to_iso_string(p - z->offset);
-    if(z && z->offset.total_seconds()) {
-      auto h = z->offset.hours();
-      auto m = z->offset.minutes();
-      auto s = z->offset.seconds();
-      
-      if(z->offset.is_negative())
-        ss << '+' << std::setfill('0') << std::setw(2) << (-h) << std::setw(2) << m;
-      else
-        ss << '-' << std::setfill('0') << std::setw(2) << h << std::setw(2) << m;
-      if(s)
-        ss << std::setw(2) << s;
-    }
-    return ss.str();
+    char buf[max_iso_string_size];
+    return std::string(buf, utc_to_local_iso_string(p, buf));
+  }
+
+  //! Local time of p in the ISO 8601 extended form followed by its offset from UTC, "2015-03-21T08:00:00-04:00"
+  std::string utc_to_local_iso_extended_string(const ptime& p) const {
+    char buf[max_iso_string_size];
+    return std::string(buf, utc_to_local_iso_string(p, buf, true));
   }
   
   #ifdef USE_ZONEINFO
+  //! Parse a zone file, storing its leap second records (time counting the earlier leap seconds, correction) in leaps if given
+  static inline time_zone read_zoneinfo(const std::string& name, const std::string& path, std::vector<std::pair<int64_t, int64_t> >* leaps,
+                                 const ptime& from = ptime(boost::posix_time::neg_infin), const ptime& to = ptime(boost::posix_time::pos_infin));
   static int_fast32_t detzcode(const char *const codep) {
       int_fast32_t  result;
       int           i;
@@ -387,162 +1259,854 @@ private:
           result = (result << 8) | (codep[i] & 0xff);
       return result;
   }
+
+  //! Append an integer as stored bytes, most significant first
+  static void tzcode(std::string& out, int64_t v, int stored) {
+    for(int i=stored-1; i>=0; --i)
+      out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+  }
+
+  //! Header and data block of a zone file, with 4 or 8 byte transition times
+  void write_zoneinfo_block(std::string& out, int stored, char version, const std::string& chars, const std::vector<std::size_t>& abbrind) const {
+    std::vector<int64_t> times;
+    std::vector<unsigned char> types;
+    for(std::size_t i=0; i<_index.utc.size(); ++i) {
+      int64_t t = _index.utc[i] / 1000000;
+      if(stored == 4 && t < std::numeric_limits<int32_t>::min()) {
+        // the segment in effect at the start of the 32 bit range
+        if(i + 1 == _index.utc.size() || _index.utc[i + 1] / 1000000 > std::numeric_limits<int32_t>::min()) {
+          times.push_back(std::numeric_limits<int32_t>::min());
+          types.push_back(static_cast<unsigned char>(_index.type[i]));
+        }
+        continue;
+      }
+      if(stored == 4 && t > std::numeric_limits<int32_t>::max())
+        break;
+      times.push_back(t);
+      types.push_back(static_cast<unsigned char>(_index.type[i]));
+    }
+
+    out.append(TZ_MAGIC, 4);
+    out.push_back(version);
+    out.append(15, '\0');
+    tzcode(out, 0, 4);                        // ttisutcnt
+    tzcode(out, 0, 4);                        // ttisstdcnt
+    tzcode(out, 0, 4);                        // leapcnt
+    tzcode(out, times.size(), 4);             // timecnt
+    tzcode(out, _index.types.size(), 4);      // typecnt
+    tzcode(out, chars.size(), 4);             // charcnt
+    for(auto it=times.begin(); it!=times.end(); ++it)
+      tzcode(out, *it, stored);
+    out.append(types.begin(), types.end());
+    for(std::size_t i=0; i<_index.types.size(); ++i) {
+      tzcode(out, -_index.types[i].offset.total_seconds(), 4);
+      out.push_back(_index.types[i].dst ? 1 : 0);
+      out.push_back(static_cast<char>(abbrind[i]));
+    }
+    out.append(chars);
+  }
   #endif //USE_ZONEINFO
 
   friend class time_zone_database;
+  friend class leap_second_table;
   friend class local_date_time;
+  friend class time_zone_normalizer;
 }; 
   
 
-class time_zone_database {
+//! Leap seconds as the difference TAI - UTC from given UTC times on, to convert between TAI, UTC and local times.
+//! TAI times count the SI seconds since 1970-01-01 00:00:00 TAI; UTC times are POSIX times, without leap seconds.
+//! Times before the first entry use its difference; a TAI time inside an inserted leap second maps to the UTC
+//! time that follows it.
+class leap_second_table {
 public:
-  
-  time_zone_database() { }
+  leap_second_table() { }
 
-  bool save_to_file(const std::string& filename) {
-    std::ofstream f(filename);
-    if(!f.is_open())
-      return false;
-    
-    for(auto tzit=_timezones.begin(); tzit!=_timezones.end(); ++tzit) {
-      for(auto it=tzit->second->_data.begin(); it!=tzit->second->_data.end(); ++it) {
-        f << tzit->first << ","
-          << detail::ptime_to_microseconds(it->first) << ","
-          << (it->second.offset.hours()*3600 + it->second.offset.minutes()*60 + it->second.offset.seconds()) << ","
-          << it->second.tz << ","
-          << (it->second.dst ? 1 : 0)
-          << std::endl;
-      }
-    }
-    
-    return true; 
+  //! TAI - UTC is tai_minus_utc seconds from the UTC time utc_microsecs on
+  void add_entry(int64_t utc_microsecs, long tai_minus_utc) {
+    std::size_t i = std::upper_bound(_utc.begin(), _utc.end(), utc_microsecs) - _utc.begin();
+    if(i && _utc[i - 1] == utc_microsecs)
+      throw local_time_exception("Failed adding entry to the leap second table.");
+    _utc.insert(_utc.begin() + i, utc_microsecs);
+    _offset.insert(_offset.begin() + i, tai_minus_utc * INT64_C(1000000));
+    _tai.insert(_tai.begin() + i, utc_microsecs + tai_minus_utc * INT64_C(1000000));
   }
-  
-  
-  bool load_from_file(const std::string& filename) {
-    enum db_fields { NAME, ISOTIME, OFFSET, ABBR, DSTADJUST, FIELD_COUNT };  
-    
-    std::ifstream f(filename);
-    if(!f.is_open())
-      return false;
-    std::string line;
-    map_type _timezones_new;
-    while(getline(f, line)) {
-      auto result = parse_string(line);
-      // make sure we got the right number of fields
-      if(result.size() != FIELD_COUNT) {
-        std::ostringstream msg;
-        msg << "Expecting " << FIELD_COUNT << " fields, got " 
-              << result.size() << " fields in line: " << line;      
-        throw std::runtime_error(msg.str());
-      }
-      // read the information, cast to appropriate values
-      int64_t msecs = atoll(result[1].c_str());
-      ptime pt = detail::microseconds_to_ptime(msecs);
-      time_zone_entry_info tze(std::atol(result[2].c_str()), result[3], (result[4] == "1"));
-
-      auto tz_it = _timezones_new.find(result[0]);
-      if(tz_it == _timezones_new.end()) {
-        time_zone_ptr tz = time_zone_ptr(new time_zone(result[0]));
-        tz_it = _timezones_new.insert(std::make_pair(result[0], tz)).first;
-      }
-      tz_it->second->_data.insert(std::make_pair(pt, tze));
-    }
 
-    // copy other timezones from existing variable
-    _timezones_new.insert(_timezones.begin(), _timezones.end());
-    
-    // assign to member data
-    _timezones.swap(_timezones_new);
-    
-    return true;
+  std::size_t size() const { return _utc.size(); }
+
+  bool empty() const { return _utc.empty(); }
+
+  //! Load a leap-seconds.list file, as published by the IERS and shipped with tzdata
+  inline bool load_from_file(const std::string& filename);
+
+  static inline leap_second_table from_file(const std::string& filename);
+
+  #ifdef USE_ZONEINFO
+  //! The leap second records of a zone file, such as the ones under right/
+  static inline leap_second_table from_zoneinfo(const std::string& name = "right/UTC", const std::string& path = TZDIR);
+  #endif
+
+  template<class Resolution = microsecond_resolution>
+  int64_t utc_to_tai(int64_t utc) const {
+    std::size_t cursor = 0;
+    return utc_to_tai<Resolution>(utc, cursor);
   }
 
+  template<class Resolution = microsecond_resolution>
+  int64_t tai_to_utc(int64_t tai) const {
+    std::size_t cursor = 0;
+    return tai_to_utc<Resolution>(tai, cursor);
+  }
 
-  bool load_from_struct(const std::map<std::string, std::vector<std::tuple<int64_t, long, std::string, bool> > >& data) {
+  //! Local time in a zone of a TAI time
+  template<class Resolution = microsecond_resolution>
+  int64_t tai_to_local(int64_t tai, const time_zone& tz) const {
+    return tz.to_local<Resolution>(tai_to_utc<Resolution>(tai));
+  }
 
-    try {
-      map_type _timezones_new;
-      for(auto zone_it=data.begin(); zone_it!=data.end(); ++zone_it) {
-        auto tz_it = _timezones_new.find(zone_it->first);
-        if(tz_it == _timezones_new.end()) {
-          time_zone_ptr tz = time_zone_ptr(new time_zone(zone_it->first));
-          tz_it = _timezones_new.insert(std::make_pair(zone_it->first, tz)).first;
-        }
-        for(auto it=zone_it->second.begin(); it!=zone_it->second.end(); ++it) {
-          // read the information, cast to appropriate values
-          ptime pt = detail::microseconds_to_ptime(std::get<0>(*it));
-          time_zone_entry_info tze(std::get<1>(*it), std::get<2>(*it), std::get<3>(*it));
-    
-          tz_it->second->_data.insert(std::make_pair(pt, std::move(tze)));
-        }
-      }
+  //! TAI time of a local time in a zone, throwing like local_date_time on ambiguous or invalid times
+  template<class Resolution = microsecond_resolution>
+  int64_t local_to_tai(int64_t local, const time_zone& tz, time_zone::automatic_conversion dst = time_zone::THROW_ON_AMBIGUOUS) const {
+    return utc_to_tai<Resolution>(tz.to_utc<Resolution>(local, dst));
+  }
 
-      // copy other timezones from existing variable
-      _timezones_new.insert(_timezones.begin(), _timezones.end());
-      
-      // assign to member data
-      _timezones.swap(_timezones_new);
-    }
-    catch(...) {
-      return false;
+  //! Batch forms over count values; sorted input only moves forward in the table
+  template<class Resolution = microsecond_resolution>
+  void utc_to_tai(const int64_t* utc, std::size_t count, int64_t* out) const {
+    std::size_t cursor = 0;
+    for(std::size_t i=0; i<count; ++i)
+      out[i] = utc_to_tai<Resolution>(utc[i], cursor);
+  }
+
+  template<class Resolution = microsecond_resolution>
+  void tai_to_utc(const int64_t* tai, std::size_t count, int64_t* out) const {
+    std::size_t cursor = 0;
+    for(std::size_t i=0; i<count; ++i)
+      out[i] = tai_to_utc<Resolution>(tai[i], cursor);
+  }
+
+  template<class Resolution = microsecond_resolution>
+  void tai_to_local(const int64_t* tai, std::size_t count, int64_t* out, const time_zone& tz) const {
+    tai_to_utc<Resolution>(tai, count, out);
+    std::size_t cursor = 0;
+    for(std::size_t i=0; i<count; ++i)
+      out[i] -= tz.utc_offset<Resolution>(out[i], cursor);
+  }
+
+private:
+  std::vector<int64_t>  _utc;       //!< UTC time from which each difference applies, in microseconds
+  std::vector<int64_t>  _tai;       //!< the same times in TAI
+  std::vector<int64_t>  _offset;    //!< TAI - UTC, in microseconds
+
+  //! Last entry of a table not after t, in ticks of Ticks per microsecond, 0 if there is none, trying the previous answer and its successor first
+  template<int64_t Ticks>
+  static std::size_t find(const std::vector<int64_t>& table, int64_t t, std::size_t cursor) {
+    if(cursor < table.size() && detail::reached<Ticks>(table[cursor], t)) {
+      if(cursor + 1 == table.size() || !detail::reached<Ticks>(table[cursor + 1], t))
+        return cursor;
+      if(cursor + 2 == table.size() || !detail::reached<Ticks>(table[cursor + 2], t))
+        return cursor + 1;
     }
+    std::size_t i = std::upper_bound(table.begin(), table.end(), t, [](int64_t v, int64_t start) { return !detail::reached<Ticks>(start, v); }) - table.begin();
+    return i ? i - 1 : 0;
+  }
 
-    return true;  
+  template<class Resolution>
+  int64_t utc_to_tai(int64_t utc, std::size_t& cursor) const {
+    if(_utc.empty())
+      return utc;
+    cursor = find<Resolution::ticks_per_microsecond>(_utc, utc, cursor);
+    return utc + _offset[cursor] * Resolution::ticks_per_microsecond;
   }
 
-  static time_zone_database from_file(const std::string& filename) {
-    time_zone_database tzdb;
-    if(!tzdb.load_from_file(filename))
-      throw std::runtime_error("Error loading time zone database file");
-    return tzdb;
+  template<class Resolution>
+  int64_t tai_to_utc(int64_t tai, std::size_t& cursor) const {
+    if(_tai.empty())
+      return tai;
+    cursor = find<Resolution::ticks_per_microsecond>(_tai, tai, cursor);
+    int64_t utc = tai - _offset[cursor] * Resolution::ticks_per_microsecond;
+    if(cursor + 1 < _utc.size() && utc >= _utc[cursor + 1] * Resolution::ticks_per_microsecond) // inside a leap second
+      utc = _utc[cursor + 1] * Resolution::ticks_per_microsecond;
+    return utc;
   }
+};
+
+
+//! A UTC range over which a zone used an abbreviation with a given offset and DST flag
+struct time_zone_abbreviation_use {
+  time_zone_abbreviation_use(const std::string& z, int64_t f, int64_t t) : zone(z), from(f), to(t) { }
+
+  std::string   zone;     //!< region id
+  int64_t       from;     //!< start of the range, in microseconds since the epoch
+  int64_t       to;       //!< end of the range, excluded
+};
+
+
+//! Changes between two versions of a time zone database, applied with time_zone_database::apply_update
+struct time_zone_update {
+  typedef std::tuple<int64_t, long, std::string, bool> entry_type;
+
+  struct zone_change {
+    zone_change(const std::string& n, bool r, int64_t f, int64_t t) : name(n), remove(r), from(f), to(t) { }
+
+    std::string               name;       //!< region id
+    bool                      remove;     //!< drop the region altogether
+    int64_t                   from;       //!< first transition time replaced, in microseconds since the epoch
+    int64_t                   to;         //!< last transition time replaced, in microseconds since the epoch
+    std::vector<entry_type>   entries;    //!< transitions replacing the ones in [from, to]
+  };
+
+  std::vector<zone_change>    changes;
+
+  //! Write the update as comma separated "remove,id", "range,id,from,to" and "entry,id,time,offset,abbr,dst" lines
+  inline bool save_to_file(const std::string& filename) const;
+
+  inline bool load_from_file(const std::string& filename);
+
+  static inline time_zone_update from_file(const std::string& filename);
+};
+
+
+class time_zone_database {
+public:
   
-  static time_zone_database from_struct(const std::map<std::string, std::vector<std::tuple<int64_t, long, std::string, bool> > >& data) {
-    time_zone_database tzdb;
-    if(!tzdb.load_from_struct(data))
-      throw std::runtime_error("Error loading time zone database struct");
-    return tzdb;
+  time_zone_database() : _generation(0) { }
+
+  //! Copies share the abbreviation index; it is read atomically since abbreviations() may be storing it meanwhile
+  time_zone_database(const time_zone_database& o)
+  : _timezones(o._timezones), _generation(o._generation), _abbreviations(std::atomic_load(&o._abbreviations))
+  #ifdef LOCAL_TIME_STATISTICS
+  , _stats(o._stats)
+  #endif
+  { }
+
+  time_zone_database(time_zone_database&&) = default;
+
+  time_zone_database& operator=(const time_zone_database& o) {
+    _timezones = o._timezones;
+    _generation = o._generation;
+    std::atomic_store(&_abbreviations, std::atomic_load(&o._abbreviations));
+    #ifdef LOCAL_TIME_STATISTICS
+    _stats = o._stats;
+    #endif
+    return *this;
   }
+
+  time_zone_database& operator=(time_zone_database&&) = default;
+
+  //! Formats understood by save_to_file; BINARY_FORMAT holds region names of up to 65535 bytes and abbreviations of
+  //! up to 255, and saving a database with longer ones fails
+  enum file_format { CSV_FORMAT, BINARY_FORMAT };
+
+  inline bool save_to_file(const std::string& filename, file_format format = CSV_FORMAT) const;
+
+  //! Save some regions only, regions not in the database being skipped; the zones are formatted on up to threads threads (0 for one per core)
+  template<class Regions>
+  bool save_to_file(const std::string& filename, const Regions& regions, file_format format, unsigned threads = 0) const;
+
+  //! Load a file written by save_to_file with BINARY_FORMAT
+  inline bool load_from_binary(const std::string& filename);
+
+  static inline time_zone_database from_binary(const std::string& filename);
+
+  //! Publish the database under the POSIX shared memory name (such as "/tzdb") for other processes to attach to.
+  //! Each call writes a new generation to the segment name.<generation> and then switches the control segment name
+  //! over to it; readers still mapping the previous generation keep it until they detach. Publishers must not race.
+  inline bool publish_shared(const std::string& name) const;
+
+  //! Attach read-only to the current generation published under name; the zones loaded are views over the segment
+  inline bool load_from_shared(const std::string& name);
+
+  static inline time_zone_database from_shared(const std::string& name);
+
+  //! Generation currently published under name, 0 if nothing is
+  static inline uint64_t shared_generation(const std::string& name);
+
+  //! Unlink the control segment and the current generation published under name
+  static inline bool remove_shared(const std::string& name);
+
+  //! Generation of the shared database last attached to, 0 if none; readers reattach when shared_generation moves on
+  uint64_t generation() const { return _generation; }
+  
+  //! Load a database file: the file is memory mapped, split at line boundaries and its slices parsed on up to threads threads (0 for one per core)
+  inline bool load_from_file(const std::string& filename, unsigned threads = 0);
+
+  //! Load the entries of a database file that the UTC times of [from, to] need: the entry in effect at from, which then
+  //! covers all earlier times, and the transitions up to to, the last of which covers all later times
+  inline bool load_from_file(const std::string& filename, const ptime& from, const ptime& to, unsigned threads = 0);
+
+  inline bool load_from_struct(const std::map<std::string, std::vector<std::tuple<int64_t, long, std::string, bool> > >& data);
+
+  //! Load the entries of a struct that the UTC times of [from, to] need, as load_from_file does
+  inline bool load_from_struct(const std::map<std::string, std::vector<std::tuple<int64_t, long, std::string, bool> > >& data, const ptime& from, const ptime& to);
+
+  static inline time_zone_database from_file(const std::string& filename);
+
+  static inline time_zone_database from_file(const std::string& filename, const ptime& from, const ptime& to);
+  
+  static inline time_zone_database from_struct(const std::map<std::string, std::vector<std::tuple<int64_t, long, std::string, bool> > >& data);
+
+  static inline time_zone_database from_struct(const std::map<std::string, std::vector<std::tuple<int64_t, long, std::string, bool> > >& data, const ptime& from, const ptime& to);
   
   bool add_record(std::string id, time_zone_ptr tz) {
     _timezones[id] = tz;
+    zones_changed();
     return true;
   }
 
   bool delete_record(std::string id){
     _timezones.erase(id);
+    zones_changed();
     return true;
   }
   
   time_zone_const_ptr time_zone_from_region(const std::string& id) const {
-    try {
-      return _timezones.at(id);
-    }
-    catch(const std::out_of_range&) {
+    auto it = _timezones.find(id);
+    if(it == _timezones.end()) {
+      LOCAL_TIME_STAT_INC(_stats.lookup_misses);
       return time_zone_ptr();
     }
+    LOCAL_TIME_STAT_INC(_stats.lookup_hits);
+    return it->second;
+  }
+
+  //! Zones and UTC ranges in which abbr stood for the offset, in seconds to add to local time as in the entries, and DST flag.
+  //! The ranges come from an index of the whole database built on first use and again after the database changes;
+  //! entries added to a zone afterwards through its own pointer are not seen.
+  std::vector<time_zone_abbreviation_use> abbreviation_uses(const std::string& abbr, long offset, bool dst) const {
+    std::shared_ptr<const abbreviation_index> index = abbreviations();
+    auto it = index->keys.find(abbreviation_key(abbr, offset, dst));
+    return it == index->keys.end() ? std::vector<time_zone_abbreviation_use>() : it->second.uses;
+  }
+
+  //! Zone in which a local time labelled with an abbreviation, as written by local_date_time::to_string, was current, with
+  //! its UTC time in utc. Of the zones using abbr then the first by name is returned, nullptr if there is none; throws
+  //! ambiguous_result if abbr stood for different offsets at that time, such as IST for Irish and Israel Standard Time.
+  time_zone_const_ptr resolve_abbreviation(const std::string& abbr, int64_t local, int64_t& utc) const {
+    std::shared_ptr<const abbreviation_index> index = abbreviations();
+    auto it = index->by_abbreviation.find(abbr);
+    return it == index->by_abbreviation.end() ? time_zone_const_ptr() : resolve(it->second, local, utc, abbr);
+  }
+
+  //! Same for a local time followed by its offset from UTC, offset being in seconds to add to local time as in the entries
+  time_zone_const_ptr resolve_offset(long offset, int64_t local, int64_t& utc) const {
+    std::shared_ptr<const abbreviation_index> index = abbreviations();
+    auto it = index->by_offset.find(offset);
+    return it == index->by_offset.end() ? time_zone_const_ptr() : resolve(it->second, local, utc, std::string());
   }
   
+  //! Changes turning the zones of from into the zones of to
+  static time_zone_update diff(const time_zone_database& from, const time_zone_database& to) {
+    time_zone_update u;
+    auto old_it = from._timezones.begin();
+    auto new_it = to._timezones.begin();
+    while(old_it != from._timezones.end() || new_it != to._timezones.end()) {
+      if(new_it == to._timezones.end() || (old_it != from._timezones.end() && old_it->first < new_it->first)) {
+        u.changes.push_back(time_zone_update::zone_change(old_it->first, true, 0, 0));
+        ++old_it;
+        continue;
+      }
+      if(old_it == from._timezones.end() || new_it->first < old_it->first) {
+        // a new zone replaces the whole time line
+        time_zone_update::zone_change c(new_it->first, false, std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max());
+        c.entries = entries_of(*new_it->second);
+        u.changes.push_back(std::move(c));
+        ++new_it;
+        continue;
+      }
+      if(old_it->second == new_it->second) {
+        ++old_it;
+        ++new_it;
+        continue;
+      }
+      std::vector<time_zone_update::entry_type> a = entries_of(*old_it->second);
+      std::vector<time_zone_update::entry_type> b = entries_of(*new_it->second);
+      const std::string& name = new_it->first;
+      ++old_it;
+      ++new_it;
+      if(a == b)
+        continue;
+
+      // the change spans from the first to the last entry differing between the two versions
+      std::size_t head = 0, tail = 0;
+      while(head < a.size() && head < b.size() && a[head] == b[head])
+        ++head;
+      while(tail < a.size() - head && tail < b.size() - head && a[a.size() - 1 - tail] == b[b.size() - 1 - tail])
+        ++tail;
+      int64_t lo = std::numeric_limits<int64_t>::max(), hi = std::numeric_limits<int64_t>::min();
+      if(head < a.size() - tail) {
+        lo = std::min(lo, std::get<0>(a[head]));
+        hi = std::max(hi, std::get<0>(a[a.size() - 1 - tail]));
+      }
+      if(head < b.size() - tail) {
+        lo = std::min(lo, std::get<0>(b[head]));
+        hi = std::max(hi, std::get<0>(b[b.size() - 1 - tail]));
+      }
+      time_zone_update::zone_change c(name, false, lo, hi);
+      c.entries.assign(b.begin() + head, b.end() - tail);
+      u.changes.push_back(std::move(c));
+    }
+    return u;
+  }
+
+  //! Apply an update copy-on-write: only the zones it mentions are rebuilt, all the others stay shared
+  bool apply_update(const time_zone_update& update) {
+    std::size_t entries = 0;
+    for(auto it=update.changes.begin(); it!=update.changes.end(); ++it) {
+      auto tz_it = _timezones.find(it->name);
+      entries += it->entries.size() + (tz_it != _timezones.end() ? tz_it->second->_index.utc.size() : 0);
+    }
+    time_zone::allocator_type alloc(std::make_shared<detail::arena>(snapshot_size(update.changes.size(), entries)));
+
+    map_type _timezones_new(_timezones);
+    try {
+      for(auto it=update.changes.begin(); it!=update.changes.end(); ++it) {
+        if(it->remove) {
+          _timezones_new.erase(it->name);
+          continue;
+        }
+        time_zone_ptr tz = std::allocate_shared<time_zone>(alloc, it->name, alloc);
+        auto old_it = _timezones_new.find(it->name);
+        if(old_it != _timezones_new.end()) {
+          const time_zone& old_tz = *old_it->second;
+          for(std::size_t i=0; i<old_tz._index.utc.size(); ++i)
+            if(old_tz._index.utc[i] < it->from || old_tz._index.utc[i] > it->to)
+              tz->_data.insert(tz->_data.end(), std::make_pair(detail::microseconds_to_ptime(old_tz._index.utc[i]), *old_tz.segment_info(i)));
+        }
+        for(auto e=it->entries.begin(); e!=it->entries.end(); ++e)
+          tz->insert_entry(std::get<0>(*e), time_zone_entry_info(std::get<1>(*e), std::get<2>(*e), std::get<3>(*e)));
+        tz->build_index();
+        _timezones_new[it->name] = tz;
+      }
+    }
+    catch(...) {
+      return false;
+    }
+    _timezones.swap(_timezones_new);
+    zones_changed();
+    return true;
+  }
+
   std::set<std::string> region_list() const {
     std::set<std::string> v;
     std::transform(_timezones.begin(), _timezones.end(), std::inserter(v, v.end()), [](const map_type::value_type& p){return p.first;});
     return v;
   }
+
+  //! Bytes used by the database, estimated like time_zone::memory_usage: the region map, the zones, each counted once,
+  //! and the abbreviation index if built
+  std::size_t memory_usage() const {
+    std::size_t bytes = sizeof(time_zone_database);
+    std::set<const time_zone*> zones;
+    for(auto it=_timezones.begin(); it!=_timezones.end(); ++it) {
+      // the shared_ptr control block holds two counts and a vtable pointer
+      bytes += detail::tree_node_bytes<map_type::value_type>() + detail::heap_bytes(it->first);
+      if(it->second && zones.insert(it->second.get()).second)
+        bytes += it->second->memory_usage() + 2 * sizeof(int) + sizeof(void*);
+    }
+    std::shared_ptr<const abbreviation_index> index = std::atomic_load(&_abbreviations);
+    if(index) {
+      bytes += sizeof(abbreviation_index);
+      for(auto it=index->keys.begin(); it!=index->keys.end(); ++it) {
+        const abbreviation_entry& e = it->second;
+        bytes += sizeof(*it) + sizeof(void*) + detail::heap_bytes(it->first.abbr) + e.uses.capacity() * sizeof(time_zone_abbreviation_use)
+               + e.starts.capacity() * sizeof(int64_t) + e.zones.capacity() * sizeof(time_zone_const_ptr) + 2 * sizeof(const abbreviation_entry*);
+        for(auto u=e.uses.begin(); u!=e.uses.end(); ++u)
+          bytes += detail::heap_bytes(u->zone);
+      }
+      bytes += (index->keys.bucket_count() + index->by_abbreviation.bucket_count() + index->by_offset.bucket_count()) * sizeof(void*);
+      bytes += index->by_abbreviation.size() * (sizeof(std::pair<const std::string, std::vector<const abbreviation_entry*> >) + sizeof(void*))
+             + index->by_offset.size() * (sizeof(std::pair<const long, std::vector<const abbreviation_entry*> >) + sizeof(void*));
+    }
+    return bytes;
+  }
+
+  //! Replace every zone by its time_zone::compacted copy, dropping the segments ending by cutoff_year if given. Zones held
+  //! elsewhere keep their current form, and the memory of a loaded snapshot is released once none of its zones is left.
+  void compact(int cutoff_year = 0) {
+    std::map<const time_zone*, time_zone_ptr> done;
+    for(auto it=_timezones.begin(); it!=_timezones.end(); ++it) {
+      if(!it->second)
+        continue;
+      time_zone_ptr& c = done[it->second.get()];
+      if(!c)
+        c = it->second->compacted(cutoff_year);
+      it->second = c;
+    }
+    zones_changed();
+  }
+
+  #ifdef LOCAL_TIME_STATISTICS
+  time_zone_database_statistics statistics() const {
+    time_zone_database_statistics st;
+    st.lookup_hits = _stats.lookup_hits.get();
+    st.lookup_misses = _stats.lookup_misses.get();
+    st.loads = _stats.loads.get();
+    st.last_load_microseconds = _stats.last_load_microseconds.get();
+    st.total_load_microseconds = _stats.total_load_microseconds.get();
+    return st;
+  }
+
+  //! Counters of every zone in the database, keyed by region
+  std::map<std::string, time_zone_statistics> zone_statistics() const {
+    std::map<std::string, time_zone_statistics> m;
+    for(auto it=_timezones.begin(); it!=_timezones.end(); ++it)
+      m.insert(m.end(), std::make_pair(it->first, it->second->statistics()));
+    return m;
+  }
+
+  //! Writes the database and zone counters as comma separated values
+  void export_statistics(std::ostream& out) const {
+    time_zone_database_statistics st = statistics();
+    out << "database,lookup_hits," << st.lookup_hits << "\n"
+        << "database,lookup_misses," << st.lookup_misses << "\n"
+        << "database,loads," << st.loads << "\n"
+        << "database,last_load_microseconds," << st.last_load_microseconds << "\n"
+        << "database,total_load_microseconds," << st.total_load_microseconds << "\n";
+    static const char* const policies[] = { "assume_dst", "assume_non_dst", "throw_on_ambiguous" };
+    for(auto it=_timezones.begin(); it!=_timezones.end(); ++it) {
+      time_zone_statistics zs = it->second->statistics();
+      out << it->first << ",utc_lookups," << zs.utc_lookups << "\n"
+          << it->first << ",local_lookups," << zs.local_lookups << "\n";
+      for(int i=0; i<3; ++i)
+        out << it->first << ",ambiguous_" << policies[i] << "," << zs.ambiguous[i] << "\n"
+            << it->first << ",invalid_" << policies[i] << "," << zs.invalid[i] << "\n";
+      out << it->first << ",load_microseconds," << zs.load_microseconds << "\n";
+    }
+  }
+
+  void reset_statistics() const {
+    _stats.lookup_hits = 0;
+    _stats.lookup_misses = 0;
+    for(auto it=_timezones.begin(); it!=_timezones.end(); ++it)
+      it->second->reset_statistics();
+  }
+  #endif //LOCAL_TIME_STATISTICS
   
 private:
   typedef std::map<std::string, std::shared_ptr<time_zone> > map_type;
+  typedef time_zone::data_type                                data_type;
   
   map_type                                              _timezones;
+  uint64_t                                              _generation;    //!< generation of the attached shared database
+  //! Abbreviation, offset in seconds and DST flag of a zone entry
+  struct abbreviation_key {
+    abbreviation_key(const std::string& a, long o, bool d) : abbr(a), offset(o), dst(d) { }
+    bool operator==(const abbreviation_key& o) const { return offset == o.offset && dst == o.dst && abbr == o.abbr; }
+
+    std::string abbr;
+    long        offset;
+    bool        dst;
+  };
+
+  struct abbreviation_key_hash {
+    std::size_t operator()(const abbreviation_key& k) const { return std::hash<std::string>()(k.abbr) ^ (std::hash<long>()(k.offset) * 2 + k.dst); }
+  };
+
+  //! Uses of one abbreviation key, and the same flattened into disjoint ranges each naming the first zone by name current then
+  struct abbreviation_entry {
+    abbreviation_entry() : offset(0) { }
+
+    long                                      offset;
+    std::vector<time_zone_abbreviation_use>   uses;       //!< by zone, then time
+    std::vector<int64_t>                      starts;     //!< start of each disjoint range, the last one ending the coverage
+    std::vector<time_zone_const_ptr>          zones;      //!< zone of each range, null in gaps
+  };
+
+  //! Inverted index of the entries of all the zones, shared by copies of the database until either changes
+  struct abbreviation_index {
+    std::unordered_map<abbreviation_key, abbreviation_entry, abbreviation_key_hash>   keys;
+    std::unordered_map<std::string, std::vector<const abbreviation_entry*> >          by_abbreviation;
+    std::unordered_map<long, std::vector<const abbreviation_entry*> >                 by_offset;
+  };
+
+  mutable std::shared_ptr<const abbreviation_index>     _abbreviations;   //!< built on first use, reset when the zones change
+
+  void zones_changed() {
+    std::atomic_store(&_abbreviations, std::shared_ptr<const abbreviation_index>());
+  }
+
+  //! The index, built if needed; concurrent readers may each build one, the last stored being kept
+  std::shared_ptr<const abbreviation_index> abbreviations() const {
+    std::shared_ptr<const abbreviation_index> index = std::atomic_load(&_abbreviations);
+    if(index)
+      return index;
+    std::shared_ptr<abbreviation_index> built = std::make_shared<abbreviation_index>();
+    for(auto zone_it=_timezones.begin(); zone_it!=_timezones.end(); ++zone_it) {
+      if(!zone_it->second)  // add_record accepts null zones
+        continue;
+      const time_zone& tz = *zone_it->second;
+      std::size_t count = tz._index.utc.size();
+      for(std::size_t i=0; i<count; ) {
+        // merge consecutive segments using the same type; the first segment also covers the times before it
+        const time_zone_entry_info* info = tz.segment_info(i);
+        int64_t from = i ? tz._index.utc[i] : std::numeric_limits<int64_t>::min();
+        std::size_t j = i + 1;
+        for(; j<count; ++j) {
+          const time_zone_entry_info* next = tz.segment_info(j);
+          if(next->offset != info->offset || next->dst != info->dst || next->tz != info->tz)
+            break;
+        }
+        int64_t to = j < count ? tz._index.utc[j] : std::numeric_limits<int64_t>::max();
+        abbreviation_entry& e = built->keys[abbreviation_key(info->tz, info->offset.total_seconds(), info->dst)];
+        e.offset = info->offset.total_seconds();
+        e.uses.push_back(time_zone_abbreviation_use(zone_it->first, from, to));
+        i = j;
+      }
+    }
+    for(auto it=built->keys.begin(); it!=built->keys.end(); ++it) {
+      flatten(it->second);
+      built->by_abbreviation[it->first.abbr].push_back(&it->second);
+      built->by_offset[it->first.offset].push_back(&it->second);
+    }
+    index = built;
+    std::atomic_store(&_abbreviations, index);
+    return index;
+  }
+
+  //! Sweep the uses of an entry, the zones being in name order already
+  void flatten(abbreviation_entry& e) const {
+    std::vector<std::pair<int64_t, std::size_t> > events;   // time, use index; ends are flagged with the high bit
+    const std::size_t end_flag = ~(~std::size_t(0) >> 1);
+    for(std::size_t i=0; i<e.uses.size(); ++i) {
+      events.push_back(std::make_pair(e.uses[i].from, i));
+      events.push_back(std::make_pair(e.uses[i].to, i | end_flag));
+    }
+    std::sort(events.begin(), events.end());
+    std::set<std::size_t> active;   // zones are in name order, so the smallest index is the first zone by name
+    for(std::size_t i=0; i<events.size(); ) {
+      int64_t t = events[i].first;
+      for(; i<events.size() && events[i].first == t; ++i) {
+        if(events[i].second & end_flag)
+          active.erase(events[i].second & ~end_flag);
+        else
+          active.insert(events[i].second);
+      }
+      // regions are compared by zone, not name: an alias region holds a zone named after the region it aliases
+      time_zone_const_ptr zone = active.empty() ? time_zone_const_ptr() : _timezones.find(e.uses[*active.begin()].zone)->second;
+      if(!e.zones.empty() && e.zones.back() == zone)
+        continue;
+      e.starts.push_back(t);
+      e.zones.push_back(zone);
+    }
+  }
+
+  //! The first zone by name among the entries current at local, which must all give the same UTC time
+  static time_zone_const_ptr resolve(const std::vector<const abbreviation_entry*>& entries, int64_t local, int64_t& utc, const std::string& abbr) {
+    time_zone_const_ptr found;
+    for(auto it=entries.begin(); it!=entries.end(); ++it) {
+      const abbreviation_entry& e = **it;
+      int64_t t = local + e.offset * INT64_C(1000000);
+      std::size_t i = std::upper_bound(e.starts.begin(), e.starts.end(), t) - e.starts.begin();
+      if(!i || !e.zones[i - 1])
+        continue;
+      if(found && t != utc)
+        throw ambiguous_result(abbr, detail::to_iso_string(detail::microseconds_to_ptime(local)));
+      if(!found || e.zones[i - 1]->name() < found->name()) {
+        found = e.zones[i - 1];
+        utc = t;
+      }
+    }
+    return found;
+  }
+
+  #ifdef LOCAL_TIME_STATISTICS
+  struct counters {
+    detail::stat_counter  lookup_hits;
+    detail::stat_counter  lookup_misses;
+    detail::stat_counter  loads;
+    detail::stat_counter  last_load_microseconds;
+    detail::stat_counter  total_load_microseconds;
+  };
+  mutable counters                                      _stats;
+  
+  void record_load(uint64_t microseconds) {
+    LOCAL_TIME_STAT_INC(_stats.loads);
+    _stats.last_load_microseconds = microseconds;
+    _stats.total_load_microseconds.fetch_add(microseconds, std::memory_order_relaxed);
+  }
+  #endif
     
-  static std::vector<std::string> parse_string(const std::string& s) {
-    std::vector<std::string> v;
-    boost::tokenizer<boost::escaped_list_separator<char> > tok(s);
-    std::transform(tok.begin(), tok.end(), std::back_inserter(v), [](const std::string& p){return p;}); 
+  //! Leading bytes of the binary format, the last one being the format version
+  static const char* binary_magic() { return "LDTB\x01"; }
+  enum { binary_magic_size = 5 };
+
+  //! Rows "id,microseconds,offset,abbr,dst" of a zone, straight from its index
+  static void write_csv(std::string& out, const std::string& id, const time_zone& tz) {
+    const time_zone::segment_index& idx = tz._index;
+    for(std::size_t i=0; i<idx.utc.size(); ++i) {
+      const time_zone_entry_info& info = idx.types[idx.type[i]];
+      out.append(id);
+      out.push_back(',');
+      detail::append_integer(out, idx.utc[i]);
+      out.push_back(',');
+      detail::append_integer(out, idx.offset[i] / 1000000);
+      out.push_back(',');
+      out.append(info.tz);
+      out.append(info.dst ? ",1\n" : ",0\n", 3);
+    }
+  }
+
+  //! Whether the sizes of the region name and abbreviations fit the fields of write_binary
+  static bool binary_fits(const std::string& id, const time_zone& tz) {
+    if(id.size() > 0xFFFF)
+      return false;
+    for(auto it=tz._index.types.begin(); it!=tz._index.types.end(); ++it)
+      if(it->tz.size() > 0xFF)
+        return false;
+    return true;
+  }
+
+  //! Zone name, type table, then transition times and their types, all little endian
+  static void write_binary(std::string& out, const std::string& id, const time_zone& tz) {
+    const time_zone::segment_index& idx = tz._index;
+    detail::append_le(out, id.size(), 2);
+    out.append(id);
+    detail::append_le(out, idx.types.size(), 2);
+    for(auto it=idx.types.begin(); it!=idx.types.end(); ++it) {
+      detail::append_le(out, static_cast<uint64_t>(it->offset.total_seconds()), 4);
+      detail::append_le(out, it->dst ? 1 : 0, 1);
+      detail::append_le(out, it->tz.size(), 1);
+      out.append(it->tz);
+    }
+    detail::append_le(out, idx.utc.size(), 4);
+    for(auto it=idx.utc.begin(); it!=idx.utc.end(); ++it)
+      detail::append_le(out, static_cast<uint64_t>(*it), 8);
+    for(auto it=idx.type.begin(); it!=idx.type.end(); ++it)
+      detail::append_le(out, *it, 2);
+  }
+
+  static const char* shared_magic() { return "LDTSHM\x01"; }
+
+  //! Database image for publish_shared, aligned to 8 bytes throughout
+  inline std::string write_shared() const;
+
+  static std::vector<time_zone_update::entry_type> entries_of(const time_zone& tz) {
+    std::vector<time_zone_update::entry_type> v;
+    v.reserve(tz._index.utc.size());
+    for(std::size_t i=0; i<tz._index.utc.size(); ++i) {
+      const time_zone_entry_info* info = tz.segment_info(i);
+      v.push_back(time_zone_update::entry_type(tz._index.utc[i], info->offset.total_seconds(), info->tz, info->dst));
+    }
     return v;
   }
+
+  //! Upper estimate of the arena space needed by a snapshot of a number of zones and transitions
+  static std::size_t snapshot_size(std::size_t zones, std::size_t entries) {
+    return zones * (2 * sizeof(time_zone) + 2 * detail::index_bucket_count * sizeof(uint16_t) + sizeof(time_zone_entry_info) + sizeof(detail::iso_offset) + 128)
+         + entries * (sizeof(data_type::value_type) + 4 * sizeof(void*) + 3 * sizeof(int64_t) + sizeof(uint16_t) + sizeof(time_zone_entry_info));
+  }
 };
 
 
+//! Local time of a message and the index of its zone in a time_zone_normalizer
+struct zoned_time {
+  uint32_t  zone;     //!< index of the zone in the normalizer
+  int64_t   local;    //!< local time, as an integer of the resolution
+};
+
+//! Converts local times of a fixed set of zones to UTC. The zones are resolved once into a dense table, so a message
+//! only carries the index of its zone; batches are grouped by zone with a stable counting sort and each group is
+//! converted with the path of its zone, keeping its segment from one time to the next, before the results are
+//! written back in the order of the batch. The normalizer holds its zones, so later changes of a database are not seen.
+class time_zone_normalizer {
+public:
+  static const std::size_t npos = static_cast<std::size_t>(-1);
+
+  //! Resolve the regions of a database, throwing std::runtime_error on a region the database does not have
+  time_zone_normalizer(const time_zone_database& db, const std::vector<std::string>& regions, time_zone::automatic_conversion dst = time_zone::THROW_ON_AMBIGUOUS) : _dst(dst) {
+    for(auto it=regions.begin(); it!=regions.end(); ++it) {
+      time_zone_const_ptr tz = db.time_zone_from_region(*it);
+      if(!tz)
+        throw std::runtime_error("Unknown time zone region '" + *it + "'");
+      add(*it, tz);
+    }
+  }
+
+  //! Use the given zones, indexed by their position and found by their names
+  explicit time_zone_normalizer(const std::vector<time_zone_const_ptr>& zones, time_zone::automatic_conversion dst = time_zone::THROW_ON_AMBIGUOUS) : _dst(dst) {
+    for(auto it=zones.begin(); it!=zones.end(); ++it) {
+      if(!*it)
+        throw std::runtime_error("Null time zone");
+      add((*it)->name(), *it);
+    }
+  }
+
+  std::size_t size() const { return _table.size(); }
+
+  const time_zone& zone(std::size_t i) const { return *_table.at(i); }
+
+  //! Index of a region or zone name, npos if not in the table; meant for resolving sources once, not per message
+  std::size_t index_of(const std::string& name) const {
+    auto it = std::find(_names.begin(), _names.end(), name);
+    return it == _names.end() ? npos : it - _names.begin();
+  }
+
+  //! UTC time of one local time; throws std::out_of_range on a zone index outside the table
+  template<class Resolution = microsecond_resolution>
+  int64_t to_utc(uint32_t zone, int64_t local) const {
+    const time_zone& tz = *_table.at(zone);
+    LOCAL_TIME_STAT_INC(tz._stats.local_lookups);
+    std::size_t cursor = 0;
+    return local + tz.local_offset<Resolution>(local, cursor, _dst);
+  }
+
+  //! UTC times of count local times, out[i] being the UTC time of times[i]. Throws std::out_of_range on a zone index
+  //! outside the table, before converting anything, and like local_date_time on ambiguous or invalid times, leaving
+  //! out partly written.
+  template<class Resolution = microsecond_resolution>
+  void to_utc(const zoned_time* times, std::size_t count, int64_t* out) const {
+    std::vector<std::size_t> starts(_table.size() + 1, 0);
+    for(std::size_t i=0; i<count; ++i) {
+      if(times[i].zone >= _table.size())
+        throw std::out_of_range("Time zone index out of range");
+      ++starts[times[i].zone + 1];
+    }
+    for(std::size_t z=0; z<_table.size(); ++z)
+      starts[z + 1] += starts[z];
+    std::vector<std::size_t> next(starts.begin(), starts.end() - 1);
+    std::vector<std::size_t> order(count);
+    for(std::size_t i=0; i<count; ++i)
+      order[next[times[i].zone]++] = i;
+
+    for(std::size_t z=0; z<_table.size(); ++z) {
+      const time_zone& tz = *_table[z];
+      const std::size_t* first = order.data() + starts[z];
+      const std::size_t* last = order.data() + starts[z + 1];
+      if(first == last)
+        continue;
+      #ifdef LOCAL_TIME_STATISTICS
+      tz._stats.local_lookups.fetch_add(last - first, std::memory_order_relaxed);
+      #endif
+      std::size_t cursor = 0;
+      if(tz._index.kind != time_zone::VARIABLE_OFFSET_ZONE) {
+        int64_t offset = tz.local_offset<Resolution>(0, cursor, _dst);
+        for(; first!=last; ++first)
+          out[*first] = times[*first].local + offset;
+        continue;
+      }
+      for(; first!=last; ++first)
+        out[*first] = times[*first].local + tz.local_offset<Resolution>(times[*first].local, cursor, _dst);
+    }
+  }
+
+  void to_utc(const std::vector<zoned_time>& times, std::vector<int64_t>& out) const {
+    out.resize(times.size());
+    to_utc(times.data(), times.size(), out.data());
+  }
+
+private:
+  void add(const std::string& name, const time_zone_const_ptr& tz) {
+    _names.push_back(name);
+    _zones.push_back(tz);
+    _table.push_back(tz.get());
+  }
+
+  std::vector<std::string>            _names;   //!< region or zone name of each index
+  std::vector<time_zone_const_ptr>    _zones;   //!< keeps the zones alive
+  std::vector<const time_zone*>       _table;   //!< the zones by index, what conversions read
+  time_zone::automatic_conversion     _dst;     //!< policy for ambiguous local times
+};
+
 }
 #endif
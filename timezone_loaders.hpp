@@ -0,0 +1,1389 @@
+#ifndef LOCAL_DATE_TIME_TIMEZONE_LOADERS_HPP
+#define LOCAL_DATE_TIME_TIMEZONE_LOADERS_HPP
+
+// File loaders and writers of the time zone classes: CSV and binary databases, updates, structs, leap second
+// lists and zoneinfo files, databases published in POSIX shared memory, and time_zone_database_watcher, which
+// reloads them as they change. timezone.hpp only declares these members, so translation units doing conversions
+// alone need neither this header nor Boost.Filesystem, the POSIX headers or librt.
+
+#include "timezone.hpp"
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include <boost/tokenizer.hpp>
+#include <boost/version.hpp>
+
+namespace local_time {
+
+namespace detail {
+
+//! Split a comma separated line into its fields
+inline std::vector<std::string> parse_csv_line(const std::string& s) {
+  std::vector<std::string> v;
+  boost::tokenizer<boost::escaped_list_separator<char> > tok(s);
+  std::transform(tok.begin(), tok.end(), std::back_inserter(v), [](const std::string& p){return p;}); 
+  return v;
+}
+
+//! Threads joined when the group goes out of scope, so that an exception thrown while starting or running them,
+//! such as std::system_error from a thread constructor, does not destroy a joinable thread
+class thread_group {
+public:
+  explicit thread_group(std::size_t count) { _threads.reserve(count); }
+  thread_group(const thread_group&) = delete;
+  thread_group& operator=(const thread_group&) = delete;
+  ~thread_group() { join(); }
+
+  template<class... Args>
+  void start(Args&&... args) { _threads.emplace_back(std::forward<Args>(args)...); }
+
+  void join() {
+    for(auto it=_threads.begin(); it!=_threads.end(); ++it)
+      if(it->joinable())
+        it->join();
+  }
+
+private:
+  std::vector<std::thread>  _threads;   //!< reserved up front, so that starting a thread never moves the others
+};
+
+//! Read-only view of a whole file, memory mapped
+class mapped_file {
+public:
+  explicit mapped_file(const std::string& filename) : _data(nullptr), _size(0), _good(false) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+      return;
+    struct stat st;
+    if(::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      _size = st.st_size;
+      if(!_size)
+        _good = true;
+      else {
+        void* p = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p != MAP_FAILED) {
+          _data = static_cast<const char*>(p);
+          _good = true;
+        }
+      }
+    }
+    ::close(fd);
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  ~mapped_file() {
+    if(_data)
+      ::munmap(const_cast<char*>(_data), _size);
+  }
+
+  bool good() const { return _good; }
+  const char* data() const { return _data; }
+  std::size_t size() const { return _size; }
+
+private:
+  const char*   _data;
+  std::size_t   _size;
+  bool          _good;
+};
+
+//! One line of a database file, pointing into the file or into the owning chunk's storage
+struct csv_record {
+  const char*   zone;
+  std::size_t   zone_size;
+  const char*   abbr;
+  std::size_t   abbr_size;
+  int64_t       time;
+  long          offset;
+  bool          dst;
+};
+
+//! Integer from a field, stopping at the first character that is not a digit like atoll
+inline int64_t scan_integer(const char* b, const char* e) {
+  while(b != e && (*b == ' ' || *b == '\t'))
+    ++b;
+  bool negative = false;
+  if(b != e && (*b == '-' || *b == '+'))
+    negative = *b++ == '-';
+  uint64_t v = 0;
+  for(; b != e && *b >= '0' && *b <= '9'; ++b)
+    v = v * 10 + (*b - '0');
+  return negative ? -static_cast<int64_t>(v) : static_cast<int64_t>(v);
+}
+
+//! Parsed lines of a slice of a database file
+struct csv_chunk {
+  std::vector<csv_record>   records;
+  std::deque<std::string>   storage;    //!< unescaped fields of lines using quotes or escapes
+  std::exception_ptr        error;
+
+  //! Parse the lines in [b, e), e being the end of the file or just past a newline
+  void scan(const char* b, const char* e) {
+    try {
+      while(b != e) {
+        const char* eol = static_cast<const char*>(std::memchr(b, '\n', e - b));
+        const char* next = eol ? eol + 1 : e;
+        if(!eol)
+          eol = e;
+        scan_line(b, eol);
+        b = next;
+      }
+    }
+    catch(...) {
+      error = std::current_exception();
+    }
+    // sorted runs per zone, lines of a zone keeping their file order on ties
+    std::stable_sort(records.begin(), records.end(), &record_less);
+  }
+
+  static int compare_zone(const csv_record& a, const csv_record& b) {
+    int c = std::memcmp(a.zone, b.zone, std::min(a.zone_size, b.zone_size));
+    return c ? c : (a.zone_size < b.zone_size ? -1 : (a.zone_size > b.zone_size ? 1 : 0));
+  }
+
+  static bool record_less(const csv_record& a, const csv_record& b) {
+    int c = compare_zone(a, b);
+    return c < 0 || (c == 0 && a.time < b.time);
+  }
+
+  typedef std::pair<const csv_record*, const csv_record*> run_type;
+
+  //! Take the records of the smallest zone left in the sorted runs of the chunks, appending them to merged if given;
+  //! returns a record of that zone, nullptr once every run is exhausted
+  static const csv_record* merge_zone(std::vector<run_type>& runs, std::vector<const csv_record*>* merged) {
+    const csv_record* zone = nullptr;
+    for(auto it=runs.begin(); it!=runs.end(); ++it)
+      if(it->first != it->second && (!zone || compare_zone(*it->first, *zone) < 0))
+        zone = it->first;
+    if(!zone)
+      return nullptr;
+    for(auto it=runs.begin(); it!=runs.end(); ++it)
+      for(; it->first != it->second && !compare_zone(*it->first, *zone); ++it->first)
+        if(merged)
+          merged->push_back(it->first);
+    return zone;
+  }
+
+private:
+  enum db_fields { NAME, ISOTIME, OFFSET, ABBR, DSTADJUST, FIELD_COUNT };
+
+  void scan_line(const char* b, const char* e) {
+    const char* fields[FIELD_COUNT + 1];
+    std::size_t count = 0;
+    bool plain = true;
+    fields[0] = b;
+    for(const char* c=b; c!=e; ++c) {
+      if(*c == ',') {
+        if(++count == FIELD_COUNT)
+          break;
+        fields[count] = c + 1;
+      }
+      else if(*c == '"' || *c == '\\')
+        plain = false;
+    }
+    if(plain && count + 1 == FIELD_COUNT) {
+      fields[FIELD_COUNT] = e + 1;
+      csv_record r;
+      r.zone = fields[NAME];
+      r.zone_size = fields[ISOTIME] - 1 - fields[NAME];
+      r.time = scan_integer(fields[ISOTIME], fields[OFFSET] - 1);
+      r.offset = static_cast<long>(scan_integer(fields[OFFSET], fields[ABBR] - 1));
+      r.abbr = fields[ABBR];
+      r.abbr_size = fields[DSTADJUST] - 1 - fields[ABBR];
+      r.dst = e - fields[DSTADJUST] == 1 && *fields[DSTADJUST] == '1';
+      records.push_back(r);
+      return;
+    }
+
+    std::string line(b, e);
+    auto result = parse_csv_line(line);
+    // make sure we got the right number of fields
+    if(result.size() != FIELD_COUNT) {
+      std::ostringstream msg;
+      msg << "Expecting " << FIELD_COUNT << " fields, got " 
+            << result.size() << " fields in line: " << line;      
+      throw std::runtime_error(msg.str());
+    }
+    storage.push_back(result[NAME]);
+    storage.push_back(result[ABBR]);
+    csv_record r;
+    r.zone = storage[storage.size() - 2].data();
+    r.zone_size = result[NAME].size();
+    r.time = atoll(result[ISOTIME].c_str());
+    r.offset = std::atol(result[OFFSET].c_str());
+    r.abbr = storage.back().data();
+    r.abbr_size = result[ABBR].size();
+    r.dst = result[DSTADJUST] == "1";
+    records.push_back(r);
+  }
+};
+
+//! Layout of a database published in shared memory; positions are byte offsets from the start of the segment
+struct shared_header {
+  char      magic[8];
+  uint64_t  generation;
+  uint64_t  size;
+  uint64_t  zone_count;
+  uint64_t  zones;
+};
+
+struct shared_zone {
+  uint64_t  name;
+  uint64_t  name_size;
+  uint32_t  kind;
+  uint32_t  count;
+  uint32_t  type_count;
+  uint32_t  reserved;
+  int64_t   local_tail;
+  uint64_t  utc;
+  uint64_t  local;
+  uint64_t  offset;
+  uint64_t  type;
+  uint64_t  types;
+  uint64_t  utc_bucket;
+  uint64_t  local_bucket;
+};
+
+struct shared_type {
+  int64_t   offset;
+  uint64_t  abbr;
+  uint64_t  abbr_size;
+  uint32_t  dst;
+  uint32_t  reserved;
+};
+
+//! Small segment naming the current generation of a published database
+struct shared_control {
+  char                    magic[8];
+  std::atomic<uint64_t>   generation;
+};
+
+//! Read-only mapping of a shared memory object, unmapped with the last zone viewing it
+inline std::shared_ptr<const char> map_shared(const std::string& name, std::size_t& size) {
+  int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+  if(fd < 0)
+    return std::shared_ptr<const char>();
+  struct stat st;
+  void* p = MAP_FAILED;
+  if(::fstat(fd, &st) == 0 && st.st_size > 0)
+    p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(p == MAP_FAILED)
+    return std::shared_ptr<const char>();
+  size = st.st_size;
+  std::size_t length = size;
+  return std::shared_ptr<const char>(static_cast<const char*>(p), [length](const char* q){ ::munmap(const_cast<char*>(q), length); });
+}
+
+}
+
+#ifdef USE_ZONEINFO
+inline time_zone time_zone::from_zoneinfo(const std::string& name, const std::string& path) {
+  return read_zoneinfo(name, path, nullptr);
+}
+
+inline time_zone time_zone::from_zoneinfo(const std::string& name, const std::string& path, const ptime& from, const ptime& to) {
+  if(!detail::valid_window(from, to))
+    throw std::runtime_error("Invalid time window for zone file '" + name + "'");
+  return read_zoneinfo(name, path, nullptr, from, to);
+}
+
+inline void time_zone::to_zoneinfo(const std::string& path) const {
+  to_zoneinfo(path, posix_footer());
+}
+
+inline void time_zone::to_zoneinfo(const std::string& path, const std::string& footer, char version) const {
+  boost::filesystem::path file_path(path);
+  file_path /= _name;
+  if(version != '2' && version != '3')
+    throw std::runtime_error("Unsupported zone file version");
+  if(_index.types.empty() || _index.types.size() > TZ_MAX_TYPES || _index.utc.size() > TZ_MAX_TIMES)
+    throw std::runtime_error("Zone '" + _name + "' cannot be written as a zone file");
+
+  // abbreviations, each one stored once
+  std::string chars;
+  std::vector<std::size_t> abbrind;
+  for(auto it=_index.types.begin(); it!=_index.types.end(); ++it) {
+    std::size_t pos = chars.find(std::string(it->tz.c_str(), it->tz.size() + 1));
+    if(pos == std::string::npos) {
+      pos = chars.size();
+      chars.append(it->tz.c_str(), it->tz.size() + 1);
+    }
+    abbrind.push_back(pos);
+  }
+  if(chars.size() > TZ_MAX_CHARS)
+    throw std::runtime_error("Zone '" + _name + "' cannot be written as a zone file"); // LCOV_EXCL_LINE
+
+  std::string out;
+  write_zoneinfo_block(out, 4, version, chars, abbrind);
+  write_zoneinfo_block(out, 8, version, chars, abbrind);
+  out += '\n' + footer + '\n';
+
+  if(file_path.has_parent_path())
+    boost::filesystem::create_directories(file_path.parent_path());
+  std::ofstream ofs(file_path.string(), std::ios::binary);
+  ofs.write(out.data(), out.size());
+  ofs.close();
+  if(ofs.fail())
+    throw std::runtime_error("Error writing zone file '" + file_path.string() + "'");
+}
+
+inline time_zone time_zone::read_zoneinfo(const std::string& name, const std::string& path, std::vector<std::pair<int64_t, int64_t> >* leaps, const ptime& from, const ptime& to) {
+  #ifdef LOCAL_TIME_STATISTICS
+  detail::stopwatch timer;
+  #endif
+  boost::filesystem::path file_path(path);
+  file_path /= name;
+
+  // read tzhead
+  std::ifstream ifs(file_path.string(), std::ios::binary);
+  if(!ifs.good())
+    throw std::runtime_error("Error opening zone file '" + file_path.string() + "'"); // LCOV_EXCL_LINE
+  ifs.seekg(0, std::ios::beg);
+
+  union th_union_t {
+    tzhead                head;
+    const char*           ptr;
+  };
+
+  #ifndef TYPE_SIGNED
+  #define TYPE_SIGNED(type) (((type) -1) < 0)
+  #endif /* !defined TYPE_SIGNED */
+
+  /* The minimum and maximum finite time values.  */
+  static time_t const time_t_min =
+    (TYPE_SIGNED(time_t)
+    ? (time_t) -1 << (CHAR_BIT * sizeof (time_t) - 1)
+    : 0);
+  static time_t const time_t_max =
+    (TYPE_SIGNED(time_t)
+    ? - (~ 0 < 0) - ((time_t) -1 << (CHAR_BIT * sizeof (time_t) - 1))
+    : -1);
+
+    std::string contents;
+  ifs.seekg(0, std::ios::end);
+  contents.resize(ifs.tellg());
+  ifs.seekg(0, std::ios::beg);
+  ifs.read(&contents[0], contents.size());
+  ifs.close();
+
+  const char* data = contents.c_str();
+  const th_union_t *th_union = reinterpret_cast<const th_union_t*>(data);
+  const tzhead* th = &th_union->head;
+
+  if(std::string(th->tzh_magic, 4) != TZ_MAGIC)
+    throw std::runtime_error("Invalid zone file '" + file_path.string() + "'"); // LCOV_EXCL_LINE
+
+  std::vector<time_t> transitions;
+  std::vector<std::tuple<int, bool, short>> types;
+  std::vector<unsigned char> transition_types;
+  std::vector<std::pair<int64_t, int64_t> > leap_records;
+  const char* abbr;
+
+  for (int stored = 4; stored <= 8; stored *= 2) {
+    int ttisstdcnt = (int) detzcode(th->tzh_ttisstdcnt);
+    int ttisgmtcnt = (int) detzcode(th->tzh_ttisgmtcnt);
+    int leapcnt = (int) detzcode(th->tzh_leapcnt);
+    int timecnt = (int) detzcode(th->tzh_timecnt);
+    int typecnt = (int) detzcode(th->tzh_typecnt);
+    int charcnt = (int) detzcode(th->tzh_charcnt);
+
+    const char* ptr = th->tzh_charcnt + sizeof(th->tzh_charcnt);
+    if (leapcnt < 0 || leapcnt > TZ_MAX_LEAPS || typecnt <= 0 || typecnt > TZ_MAX_TYPES || timecnt < 0 || timecnt > TZ_MAX_TIMES || charcnt < 0 || charcnt > TZ_MAX_CHARS || (ttisstdcnt != typecnt && ttisstdcnt != 0) || (ttisgmtcnt != typecnt && ttisgmtcnt != 0))
+      throw std::runtime_error("Error reading zone file '" + file_path.string() + "' struct"); // LCOV_EXCL_LINE
+    if (contents.size() < (sizeof(tzhead)       /* struct tzhead */ + timecnt * stored   /* ats */ + timecnt        /* types */ + typecnt * 6        /* ttinfos */ + charcnt        /* chars */ + leapcnt * (stored + 4) /* lsinfos */ + ttisstdcnt     /* ttisstds */ + ttisgmtcnt))       /* ttisgmts */
+      throw std::runtime_error("Error reading zone file '" + file_path.string() + "' struct"); // LCOV_EXCL_LINE
+
+    transitions.reserve(timecnt);
+    transitions.resize(0);
+    for (int i = 0; i < timecnt; ++i) {
+        int_fast64_t at = stored == 4 ? detzcode(ptr) : detzcode64(ptr);
+        if(at <= time_t_max) {
+          transitions.push_back(((TYPE_SIGNED(time_t) ? at < time_t_min : at < 0) ? time_t_min : at));
+        }
+        ptr += stored;
+    }
+
+    transition_types.reserve(timecnt);
+    transition_types.resize(0);
+    for(int i=0; i<timecnt; ++i) {
+        unsigned char typ = *ptr++;
+        if (typecnt <= typ)
+          throw std::runtime_error("Error reading zone file '" + file_path.string() + "' struct"); // LCOV_EXCL_LINE
+        transition_types.push_back(typ);
+    }
+
+    types.reserve(typecnt);
+    types.resize(0);
+    for(int i = 0; i < typecnt; ++i) {
+        /* gmt offset */
+        int offset = detzcode(ptr);
+        ptr += 4;
+        /* dst */
+        if(!(*ptr < 2))
+          throw std::runtime_error("Error reading zone file '" + file_path.string() + "' struct"); // LCOV_EXCL_LINE
+        bool dst = *ptr;
+        ptr++;
+        /* abbr */
+        short abbrind = *ptr++;
+        if (! (abbrind < charcnt))
+          throw std::runtime_error("Error reading zone file '" + file_path.string() + "' struct"); // LCOV_EXCL_LINE
+        types.push_back(std::make_tuple(-offset, dst, abbrind));
+    }
+
+    abbr = ptr;
+    ptr += charcnt;
+    leap_records.resize(0);
+    for(int i = 0; i < leapcnt; ++i) {
+        int64_t at = stored == 4 ? detzcode(ptr) : detzcode64(ptr);
+        ptr += stored;
+        leap_records.push_back(std::make_pair(at, static_cast<int64_t>(detzcode(ptr))));
+        ptr += 4;
+    }
+    ptr += ttisstdcnt; // tt_ttisstd
+    ptr += ttisgmtcnt; // tt_ttisgmt
+
+    if (th->tzh_version[0] == '\0')
+        break; // LCOV_EXCL_LINE
+
+    // get ready for 8 bytes
+    th_union = reinterpret_cast<const th_union_t*>(ptr);
+    th = &th_union->head;
+  }
+
+  // transition and leap times count the leap seconds before them, the correction of the last leap
+  std::size_t leap = 0;
+  for(std::size_t i=0; i<transitions.size(); ++i) {
+    while(leap < leap_records.size() && leap_records[leap].first <= transitions[i])
+      ++leap;
+    if(leap)
+      transitions[i] -= leap_records[leap - 1].second;
+  }
+  if(leaps)
+    leaps->swap(leap_records);
+
+  time_zone this_tz(name);
+  for(std::size_t i=0; i<transitions.size(); ++i) {
+    this_tz.insert_entry(transitions[i] * 1000000, time_zone_entry_info(std::get<0>(types[transition_types[i]]), std::string(abbr + std::get<2>(types[transition_types[i]])), std::get<1>(types[transition_types[i]])));
+  }
+  // times before the first transition, and all times of fixed offset zones such as UTC, have the first type
+  if(transitions.empty() || (transition_types[0] != 0 && ptime(boost::posix_time::min_date_time) < this_tz._data.begin()->first))
+    this_tz._data.insert(std::make_pair(ptime(boost::posix_time::min_date_time), time_zone_entry_info(std::get<0>(types[0]), std::string(abbr + std::get<2>(types[0])), std::get<1>(types[0]))));
+  this_tz.restrict_entries(from, to);
+  this_tz.build_index();
+
+  #ifdef LOCAL_TIME_STATISTICS
+  this_tz._stats.load_microseconds = timer.elapsed_microseconds();
+  #endif
+  return this_tz;
+  #undef TYPE_SIGNED
+}
+#endif //USE_ZONEINFO
+
+inline bool leap_second_table::load_from_file(const std::string& filename) {
+  std::ifstream f(filename);
+  if(!f.is_open())
+    return false;
+  // NTP times count from 1900-01-01
+  const int64_t ntp_epoch = INT64_C(2208988800);
+  leap_second_table t;
+  std::string line;
+  while(std::getline(f, line)) {
+    std::size_t comment = line.find('#');
+    std::istringstream is(line.substr(0, comment));
+    int64_t ntp;
+    long offset;
+    if(is >> ntp >> offset)
+      t.add_entry((ntp - ntp_epoch) * 1000000, offset);
+    else if(line.find_first_not_of(" \t\r", 0) < comment)
+      throw std::runtime_error("Invalid leap second file line: " + line);
+  }
+  std::swap(*this, t);
+  return true;
+}
+
+inline leap_second_table leap_second_table::from_file(const std::string& filename) {
+  leap_second_table t;
+  if(!t.load_from_file(filename))
+    throw std::runtime_error("Error loading leap second file '" + filename + "'");
+  return t;
+}
+
+#ifdef USE_ZONEINFO
+inline leap_second_table leap_second_table::from_zoneinfo(const std::string& name, const std::string& path) {
+  std::vector<std::pair<int64_t, int64_t> > records;
+  time_zone::read_zoneinfo(name, path, &records);
+  leap_second_table t;
+  if(!records.empty()) // TAI - UTC was 10 seconds when leap seconds started in 1972
+    t.add_entry(INT64_C(63072000000000), 10);
+  for(std::size_t i=0; i<records.size(); ++i)
+    t.add_entry((records[i].first - (i ? records[i - 1].second : 0)) * 1000000, static_cast<long>(10 + records[i].second));
+  return t;
+}
+#endif //USE_ZONEINFO
+
+inline bool time_zone_update::save_to_file(const std::string& filename) const {
+  std::ofstream f(filename);
+  if(!f.is_open())
+    return false;
+  for(auto it=changes.begin(); it!=changes.end(); ++it) {
+    if(it->remove) {
+      f << "remove," << it->name << "\n";
+      continue;
+    }
+    f << "range," << it->name << "," << it->from << "," << it->to << "\n";
+    for(auto e=it->entries.begin(); e!=it->entries.end(); ++e)
+      f << "entry," << it->name << "," << std::get<0>(*e) << "," << std::get<1>(*e) << "," << std::get<2>(*e) << "," << (std::get<3>(*e) ? 1 : 0) << "\n";
+  }
+  return f.good();
+}
+
+inline bool time_zone_update::load_from_file(const std::string& filename) {
+  std::ifstream f(filename);
+  if(!f.is_open())
+    return false;
+  std::vector<zone_change> loaded;
+  std::string line;
+  while(getline(f, line)) {
+    auto result = detail::parse_csv_line(line);
+    if(result.size() == 2 && result[0] == "remove")
+      loaded.push_back(zone_change(result[1], true, 0, 0));
+    else if(result.size() == 4 && result[0] == "range")
+      loaded.push_back(zone_change(result[1], false, atoll(result[2].c_str()), atoll(result[3].c_str())));
+    else if(result.size() == 6 && result[0] == "entry" && !loaded.empty() && !loaded.back().remove && loaded.back().name == result[1])
+      loaded.back().entries.push_back(entry_type(atoll(result[2].c_str()), std::atol(result[3].c_str()), result[4], result[5] == "1"));
+    else
+      throw std::runtime_error("Invalid time zone update line: " + line);
+  }
+  changes.swap(loaded);
+  return true;
+}
+
+inline time_zone_update time_zone_update::from_file(const std::string& filename) {
+  time_zone_update u;
+  if(!u.load_from_file(filename))
+    throw std::runtime_error("Error loading time zone update file");
+  return u;
+}
+
+inline bool time_zone_database::save_to_file(const std::string& filename, file_format format) const {
+  return save_to_file(filename, region_list(), format, 1);
+}
+
+template<class Regions>
+bool time_zone_database::save_to_file(const std::string& filename, const Regions& regions, file_format format, unsigned threads) const {
+  std::vector<std::pair<const std::string*, const time_zone*> > zones;
+  for(auto it=regions.begin(); it!=regions.end(); ++it) {
+    auto tz_it = _timezones.find(*it);
+    if(tz_it != _timezones.end()) {
+      if(format == BINARY_FORMAT && !binary_fits(tz_it->first, *tz_it->second))
+        return false;
+      zones.push_back(std::make_pair(&tz_it->first, tz_it->second.get()));
+    }
+  }
+
+  std::ofstream f(filename, std::ios::binary);
+  if(!f.is_open())
+    return false;
+
+  std::string header;
+  if(format == BINARY_FORMAT) {
+    header.append(binary_magic(), binary_magic_size);
+    detail::append_le(header, zones.size(), 4);
+  }
+  f.write(header.data(), header.size());
+
+  // the zones are cut into blocks of about a megabyte of output; each round formats one block per thread and then
+  // writes the blocks in order, so that at most one block per thread is held at a time
+  const std::size_t block_entries = 1 << 15;
+  std::vector<std::size_t> blocks(1, 0);
+  std::size_t entries = 0;
+  for(std::size_t i=0; i<zones.size(); ++i) {
+    entries += zones[i].second->_index.utc.size() + 1;
+    if(entries >= block_entries || i + 1 == zones.size()) {
+      blocks.push_back(i + 1);
+      entries = 0;
+    }
+  }
+  if(!threads)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = static_cast<unsigned>(std::max<std::size_t>(1, std::min<std::size_t>(threads, blocks.size() - 1)));
+  std::vector<std::string> buffers(threads);
+  auto format_block = [&zones, &blocks, &buffers, format](unsigned part, std::size_t block) {
+    std::string& out = buffers[part];
+    out.clear();
+    for(std::size_t i=blocks[block]; i<blocks[block + 1]; ++i) {
+      if(format == BINARY_FORMAT)
+        write_binary(out, *zones[i].first, *zones[i].second);
+      else
+        write_csv(out, *zones[i].first, *zones[i].second);
+    }
+  };
+  for(std::size_t first=0; first + 1 < blocks.size(); first += threads) {
+    unsigned count = static_cast<unsigned>(std::min<std::size_t>(threads, blocks.size() - 1 - first));
+    {
+      detail::thread_group workers(count - 1);
+      for(unsigned i=1; i<count; ++i)
+        workers.start(format_block, i, first + i);
+      format_block(0, first);
+    }
+    for(unsigned i=0; i<count; ++i)
+      f.write(buffers[i].data(), buffers[i].size());
+  }
+  f.close();
+  return !f.fail();
+}
+
+inline bool time_zone_database::load_from_binary(const std::string& filename) {
+  #ifdef LOCAL_TIME_STATISTICS
+  detail::stopwatch timer;
+  #endif
+  detail::mapped_file f(filename);
+  if(!f.good())
+    return false;
+  const char* p = f.data();
+  const char* end = f.data() + f.size();
+  if(f.size() < binary_magic_size + 4 || std::memcmp(p, binary_magic(), binary_magic_size))
+    throw std::runtime_error("Invalid binary time zone database '" + filename + "'");
+  p += binary_magic_size;
+  std::size_t zones = detail::read_le(p, 4);
+  time_zone::allocator_type alloc(std::make_shared<detail::arena>(snapshot_size(zones, f.size() / 10)));
+
+  auto need = [&p, end, &filename](std::size_t n) {
+    if(static_cast<std::size_t>(end - p) < n)
+      throw std::runtime_error("Truncated binary time zone database '" + filename + "'");
+  };
+  map_type _timezones_new;
+  std::vector<time_zone_entry_info> types;
+  for(std::size_t z=0; z<zones; ++z) {
+    need(2);
+    std::size_t size = detail::read_le(p, 2);
+    need(size + 2);
+    std::string name(p, size);
+    p += size;
+    std::size_t typecnt = detail::read_le(p, 2);
+    types.clear();
+    for(std::size_t i=0; i<typecnt; ++i) {
+      need(6);
+      long offset = static_cast<int32_t>(detail::read_le(p, 4));
+      bool dst = detail::read_le(p, 1) != 0;
+      size = detail::read_le(p, 1);
+      need(size);
+      types.push_back(time_zone_entry_info(offset, std::string(p, size), dst));
+      p += size;
+    }
+    need(4);
+    std::size_t timecnt = detail::read_le(p, 4);
+    need(timecnt * 10);
+    const char* type_ptr = p + timecnt * 8;
+    time_zone_ptr tz = std::allocate_shared<time_zone>(alloc, name, alloc);
+    for(std::size_t i=0; i<timecnt; ++i) {
+      int64_t t = static_cast<int64_t>(detail::read_le(p, 8));
+      std::size_t type = detail::read_le(type_ptr, 2);
+      if(type >= types.size())
+        throw std::runtime_error("Invalid binary time zone database '" + filename + "'");
+      tz->_data.insert(tz->_data.end(), std::make_pair(detail::microseconds_to_ptime(t), types[type]));
+    }
+    p = type_ptr;
+    tz->build_index();
+    _timezones_new.insert(_timezones_new.end(), std::make_pair(name, tz));
+  }
+
+  // copy other timezones from existing variable
+  _timezones_new.insert(_timezones.begin(), _timezones.end());
+  _timezones.swap(_timezones_new);
+  zones_changed();
+
+  #ifdef LOCAL_TIME_STATISTICS
+  record_load(timer.elapsed_microseconds());
+  #endif
+  return true;
+}
+
+inline time_zone_database time_zone_database::from_binary(const std::string& filename) {
+  time_zone_database tzdb;
+  if(!tzdb.load_from_binary(filename))
+    throw std::runtime_error("Error loading time zone database file");
+  return tzdb;
+}
+
+inline bool time_zone_database::publish_shared(const std::string& name) const {
+  std::string buffer = write_shared();
+  int cfd = ::shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+  if(cfd < 0)
+    return false;
+  void* cp = MAP_FAILED;
+  if(::ftruncate(cfd, sizeof(detail::shared_control)) == 0)
+    cp = ::mmap(nullptr, sizeof(detail::shared_control), PROT_READ | PROT_WRITE, MAP_SHARED, cfd, 0);
+  ::close(cfd);
+  if(cp == MAP_FAILED)
+    return false; // LCOV_EXCL_LINE
+  detail::shared_control* control = static_cast<detail::shared_control*>(cp);
+  uint64_t generation = std::memcmp(control->magic, shared_magic(), sizeof(control->magic)) ? 1 : control->generation.load(std::memory_order_acquire) + 1;
+  reinterpret_cast<detail::shared_header*>(&buffer[0])->generation = generation;
+
+  std::string segment = name + "." + std::to_string(generation);
+  ::shm_unlink(segment.c_str());
+  int fd = ::shm_open(segment.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  bool ok = fd >= 0 && ::ftruncate(fd, buffer.size()) == 0;
+  if(ok) {
+    void* p = ::mmap(nullptr, buffer.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ok = p != MAP_FAILED;
+    if(ok) {
+      std::memcpy(p, buffer.data(), buffer.size());
+      ::munmap(p, buffer.size());
+    }
+  }
+  if(fd >= 0)
+    ::close(fd);
+  if(ok) {
+    std::memcpy(control->magic, shared_magic(), sizeof(control->magic));
+    control->generation.store(generation, std::memory_order_release);
+    if(generation > 1)
+      ::shm_unlink((name + "." + std::to_string(generation - 1)).c_str());
+  }
+  else
+    ::shm_unlink(segment.c_str()); // LCOV_EXCL_LINE
+  ::munmap(cp, sizeof(detail::shared_control));
+  return ok;
+}
+
+inline bool time_zone_database::load_from_shared(const std::string& name) {
+  std::shared_ptr<const char> mapping;
+  std::size_t size = 0;
+  uint64_t generation = 0;
+  // the segment of a generation is unlinked once the next one is published, so retry with the newer one
+  for(int attempt=0; !mapping && attempt<8; ++attempt) {
+    generation = shared_generation(name);
+    if(!generation)
+      return false;
+    mapping = detail::map_shared(name + "." + std::to_string(generation), size);
+  }
+  if(!mapping)
+    return false; // LCOV_EXCL_LINE
+
+  const char* base = mapping.get();
+  auto check = [size, &name](uint64_t offset, uint64_t bytes) {
+    if(offset > size || bytes > size - offset)
+      throw std::runtime_error("Invalid shared time zone database '" + name + "'");
+  };
+  check(0, sizeof(detail::shared_header));
+  const detail::shared_header* header = reinterpret_cast<const detail::shared_header*>(base);
+  if(std::memcmp(header->magic, shared_magic(), sizeof(header->magic)) || header->size != size || header->generation != generation)
+    throw std::runtime_error("Invalid shared time zone database '" + name + "'");
+  check(header->zones, header->zone_count * sizeof(detail::shared_zone));
+
+  map_type _timezones_new;
+  const detail::shared_zone* zones = reinterpret_cast<const detail::shared_zone*>(base + header->zones);
+  for(uint64_t z=0; z<header->zone_count; ++z) {
+    const detail::shared_zone& sz = zones[z];
+    uint64_t buckets = sz.kind == time_zone::VARIABLE_OFFSET_ZONE ? detail::index_bucket_count : 0;
+    check(sz.name, sz.name_size);
+    check(sz.utc, sz.count * sizeof(int64_t));
+    check(sz.local, sz.count * sizeof(int64_t));
+    check(sz.offset, sz.count * sizeof(int64_t));
+    check(sz.type, sz.count * sizeof(uint16_t));
+    check(sz.types, sz.type_count * sizeof(detail::shared_type));
+    check(sz.utc_bucket, buckets * sizeof(uint16_t));
+    check(sz.local_bucket, buckets * sizeof(uint16_t));
+    if(sz.kind > time_zone::VARIABLE_OFFSET_ZONE || (sz.count && !sz.type_count) || (sz.kind == time_zone::EMPTY_ZONE) != (sz.count == 0)
+       || (sz.kind == time_zone::VARIABLE_OFFSET_ZONE && sz.count < 2))
+      throw std::runtime_error("Invalid shared time zone database '" + name + "'");
+
+    std::string zone_name(base + sz.name, sz.name_size);
+    time_zone_ptr tz = std::make_shared<time_zone>(zone_name);
+    time_zone::segment_index& idx = tz->_index;
+    const detail::shared_type* types = reinterpret_cast<const detail::shared_type*>(base + sz.types);
+    for(uint32_t i=0; i<sz.type_count; ++i) {
+      check(types[i].abbr, types[i].abbr_size);
+      idx.types.push_back(time_zone_entry_info(static_cast<long>(types[i].offset), std::string(base + types[i].abbr, types[i].abbr_size), types[i].dst != 0));
+    }
+    idx.format_offsets();
+    idx.kind = static_cast<time_zone::zone_kind>(sz.kind);
+    idx.local_tail = sz.local_tail;
+    idx.mapping = mapping;
+    idx.utc = detail::table_view<int64_t>(reinterpret_cast<const int64_t*>(base + sz.utc), sz.count);
+    idx.local = detail::table_view<int64_t>(reinterpret_cast<const int64_t*>(base + sz.local), sz.count);
+    idx.offset = detail::table_view<int64_t>(reinterpret_cast<const int64_t*>(base + sz.offset), sz.count);
+    idx.type = detail::table_view<uint16_t>(reinterpret_cast<const uint16_t*>(base + sz.type), sz.count);
+    idx.utc_bucket = detail::table_view<uint16_t>(reinterpret_cast<const uint16_t*>(base + sz.utc_bucket), buckets);
+    idx.local_bucket = detail::table_view<uint16_t>(reinterpret_cast<const uint16_t*>(base + sz.local_bucket), buckets);
+    // types and buckets index the other tables without bounds checks in the lookups
+    for(uint64_t i=0; i<std::max<uint64_t>(sz.count, buckets); ++i)
+      if((i < sz.count && idx.type[i] >= sz.type_count) || (i < buckets && (idx.utc_bucket[i] >= sz.count || idx.local_bucket[i] >= sz.count)))
+        throw std::runtime_error("Invalid shared time zone database '" + name + "'");
+    _timezones_new.insert(_timezones_new.end(), std::make_pair(zone_name, tz));
+  }
+
+  // copy other timezones from existing variable
+  _timezones_new.insert(_timezones.begin(), _timezones.end());
+  _timezones.swap(_timezones_new);
+  zones_changed();
+  _generation = generation;
+  return true;
+}
+
+inline time_zone_database time_zone_database::from_shared(const std::string& name) {
+  time_zone_database tzdb;
+  if(!tzdb.load_from_shared(name))
+    throw std::runtime_error("Error attaching to shared time zone database '" + name + "'");
+  return tzdb;
+}
+
+inline uint64_t time_zone_database::shared_generation(const std::string& name) {
+  std::size_t size = 0;
+  std::shared_ptr<const char> mapping = detail::map_shared(name, size);
+  if(!mapping || size < sizeof(detail::shared_control))
+    return 0;
+  const detail::shared_control* control = reinterpret_cast<const detail::shared_control*>(mapping.get());
+  if(std::memcmp(control->magic, shared_magic(), sizeof(control->magic)))
+    return 0;
+  return control->generation.load(std::memory_order_acquire);
+}
+
+inline bool time_zone_database::remove_shared(const std::string& name) {
+  uint64_t generation = shared_generation(name);
+  if(generation)
+    ::shm_unlink((name + "." + std::to_string(generation)).c_str());
+  return ::shm_unlink(name.c_str()) == 0;
+}
+
+inline std::string time_zone_database::write_shared() const {
+  std::string out(sizeof(detail::shared_header), '\0');
+  auto put = [&out](const void* p, std::size_t n) -> uint64_t {
+    out.append((8 - out.size() % 8) % 8, '\0');
+    uint64_t pos = out.size();
+    out.append(static_cast<const char*>(p), n);
+    return pos;
+  };
+  std::vector<detail::shared_zone> zones(_timezones.size());
+  std::size_t z = 0;
+  for(auto it=_timezones.begin(); it!=_timezones.end(); ++it, ++z) {
+    const time_zone::segment_index& idx = it->second->_index;
+    detail::shared_zone& sz = zones[z];
+    std::memset(&sz, 0, sizeof(sz));
+    sz.name = put(it->first.data(), it->first.size());
+    sz.name_size = it->first.size();
+    sz.kind = idx.kind;
+    sz.count = static_cast<uint32_t>(idx.utc.size());
+    sz.local_tail = idx.local_tail;
+    sz.utc = put(idx.utc.begin(), idx.utc.size() * sizeof(int64_t));
+    sz.local = put(idx.local.begin(), idx.local.size() * sizeof(int64_t));
+    sz.offset = put(idx.offset.begin(), idx.offset.size() * sizeof(int64_t));
+    sz.type = put(idx.type.begin(), idx.type.size() * sizeof(uint16_t));
+    sz.utc_bucket = put(idx.utc_bucket.begin(), idx.utc_bucket.size() * sizeof(uint16_t));
+    sz.local_bucket = put(idx.local_bucket.begin(), idx.local_bucket.size() * sizeof(uint16_t));
+    std::vector<detail::shared_type> types(idx.types.size());
+    for(std::size_t i=0; i<idx.types.size(); ++i) {
+      std::memset(&types[i], 0, sizeof(types[i]));
+      types[i].offset = idx.types[i].offset.total_seconds();
+      types[i].abbr = put(idx.types[i].tz.data(), idx.types[i].tz.size());
+      types[i].abbr_size = idx.types[i].tz.size();
+      types[i].dst = idx.types[i].dst;
+    }
+    sz.type_count = static_cast<uint32_t>(types.size());
+    sz.types = put(types.data(), types.size() * sizeof(detail::shared_type));
+  }
+  detail::shared_header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, shared_magic(), sizeof(header.magic));
+  header.zone_count = zones.size();
+  header.zones = put(zones.data(), zones.size() * sizeof(detail::shared_zone));
+  header.size = out.size();
+  std::memcpy(&out[0], &header, sizeof(header));
+  return out;
+}
+
+inline bool time_zone_database::load_from_file(const std::string& filename, unsigned threads) {
+  return load_from_file(filename, ptime(boost::posix_time::neg_infin), ptime(boost::posix_time::pos_infin), threads);
+}
+
+inline bool time_zone_database::load_from_file(const std::string& filename, const ptime& from, const ptime& to, unsigned threads) {
+  if(!detail::valid_window(from, to))
+    return false;
+  #ifdef LOCAL_TIME_STATISTICS
+  detail::stopwatch timer;
+  #endif
+  
+  detail::mapped_file f(filename);
+  if(!f.good())
+    return false;
+
+  // slices of at least a megabyte each, cut right after a newline
+  if(!threads)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = static_cast<unsigned>(std::max<std::size_t>(1, std::min<std::size_t>(threads, f.size() >> 20)));
+  std::vector<const char*> bounds(1, f.data());
+  for(unsigned i=1; i<threads; ++i) {
+    const char* b = std::max(bounds.back(), f.data() + f.size() / threads * i);
+    const char* eol = static_cast<const char*>(std::memchr(b, '\n', f.data() + f.size() - b));
+    bounds.push_back(eol ? eol + 1 : f.data() + f.size());
+  }
+  bounds.push_back(f.data() + f.size());
+
+  std::vector<detail::csv_chunk> chunks(threads);
+  {
+    detail::thread_group workers(threads - 1);
+    for(unsigned i=1; i<threads; ++i)
+      workers.start(&detail::csv_chunk::scan, &chunks[i], bounds[i], bounds[i + 1]);
+    chunks[0].scan(bounds[0], bounds[1]);
+  }
+  std::size_t records = 0;
+  for(auto it=chunks.begin(); it!=chunks.end(); ++it) {
+    if(it->error)
+      std::rethrow_exception(it->error);
+    records += it->records.size();
+  }
+
+  // merge the sorted runs of the chunks, zone by zone, after a first pass counting the zones to size the arena
+  std::vector<detail::csv_chunk::run_type> runs;
+  for(auto it=chunks.begin(); it!=chunks.end(); ++it)
+    if(!it->records.empty())
+      runs.push_back(std::make_pair(it->records.data(), it->records.data() + it->records.size()));
+  std::size_t zone_count = 0;
+  {
+    std::vector<detail::csv_chunk::run_type> counting(runs);
+    while(detail::csv_chunk::merge_zone(counting, nullptr))
+      ++zone_count;
+  }
+  time_zone::allocator_type alloc(std::make_shared<detail::arena>(snapshot_size(zone_count, records)));
+  map_type _timezones_new;
+  std::vector<const detail::csv_record*> merged;
+  while(true) {
+    merged.clear();
+    if(!detail::csv_chunk::merge_zone(runs, &merged))
+      break;
+    std::stable_sort(merged.begin(), merged.end(), [](const detail::csv_record* a, const detail::csv_record* b){ return a->time < b->time; });
+    auto window = detail::window_bounds(merged.begin(), merged.end(), from, to, [](const detail::csv_record* r) { return detail::microseconds_to_ptime(r->time); });
+
+    std::string name(merged[0]->zone, merged[0]->zone_size);
+    time_zone_ptr tz = std::allocate_shared<time_zone>(alloc, name, alloc);
+    for(auto it=window.first; it!=window.second; ++it)
+      tz->_data.insert(tz->_data.end(), std::make_pair(detail::microseconds_to_ptime((*it)->time), time_zone_entry_info((*it)->offset, std::string((*it)->abbr, (*it)->abbr_size), (*it)->dst)));
+    tz->build_index();
+    _timezones_new.insert(_timezones_new.end(), std::make_pair(name, tz));
+  }
+
+  // copy other timezones from existing variable
+  _timezones_new.insert(_timezones.begin(), _timezones.end());
+  
+  // assign to member data
+  _timezones.swap(_timezones_new);
+  zones_changed();
+
+  #ifdef LOCAL_TIME_STATISTICS
+  record_load(timer.elapsed_microseconds());
+  #endif
+  return true;
+}
+
+inline bool time_zone_database::load_from_struct(const std::map<std::string, std::vector<std::tuple<int64_t, long, std::string, bool> > >& data) {
+  return load_from_struct(data, ptime(boost::posix_time::neg_infin), ptime(boost::posix_time::pos_infin));
+}
+
+inline bool time_zone_database::load_from_struct(const std::map<std::string, std::vector<std::tuple<int64_t, long, std::string, bool> > >& data, const ptime& from, const ptime& to) {
+  if(!detail::valid_window(from, to))
+    return false;
+  #ifdef LOCAL_TIME_STATISTICS
+  detail::stopwatch timer;
+  #endif
+  try {
+    // size the arena so that the whole snapshot fits in its first block
+    std::size_t entries = 0;
+    for(auto zone_it=data.begin(); zone_it!=data.end(); ++zone_it)
+      entries += zone_it->second.size();
+    time_zone::allocator_type alloc(std::make_shared<detail::arena>(snapshot_size(data.size(), entries)));
+
+    map_type _timezones_new;
+    for(auto zone_it=data.begin(); zone_it!=data.end(); ++zone_it) {
+      auto tz_it = _timezones_new.find(zone_it->first);
+      if(tz_it == _timezones_new.end()) {
+        time_zone_ptr tz = std::allocate_shared<time_zone>(alloc, zone_it->first, alloc);
+        tz_it = _timezones_new.insert(std::make_pair(zone_it->first, tz)).first;
+      }
+      for(auto it=zone_it->second.begin(); it!=zone_it->second.end(); ++it) {
+        // read the information, cast to appropriate values
+        ptime pt = detail::microseconds_to_ptime(std::get<0>(*it));
+        time_zone_entry_info tze(std::get<1>(*it), std::get<2>(*it), std::get<3>(*it));
+  
+        tz_it->second->_data.insert(std::make_pair(pt, std::move(tze)));
+      }
+      tz_it->second->restrict_entries(from, to);
+      tz_it->second->build_index();
+    }
+
+    // copy other timezones from existing variable
+    _timezones_new.insert(_timezones.begin(), _timezones.end());
+    
+    // assign to member data
+    _timezones.swap(_timezones_new);
+    zones_changed();
+  }
+  catch(...) {
+    return false;
+  }
+
+  #ifdef LOCAL_TIME_STATISTICS
+  record_load(timer.elapsed_microseconds());
+  #endif
+  return true;  
+}
+
+inline time_zone_database time_zone_database::from_file(const std::string& filename) {
+  time_zone_database tzdb;
+  if(!tzdb.load_from_file(filename))
+    throw std::runtime_error("Error loading time zone database file");
+  return tzdb;
+}
+
+inline time_zone_database time_zone_database::from_file(const std::string& filename, const ptime& from, const ptime& to) {
+  time_zone_database tzdb;
+  if(!tzdb.load_from_file(filename, from, to))
+    throw std::runtime_error("Error loading time zone database file");
+  return tzdb;
+}
+
+inline time_zone_database time_zone_database::from_struct(const std::map<std::string, std::vector<std::tuple<int64_t, long, std::string, bool> > >& data) {
+  time_zone_database tzdb;
+  if(!tzdb.load_from_struct(data))
+    throw std::runtime_error("Error loading time zone database struct");
+  return tzdb;
+}
+
+inline time_zone_database time_zone_database::from_struct(const std::map<std::string, std::vector<std::tuple<int64_t, long, std::string, bool> > >& data, const ptime& from, const ptime& to) {
+  time_zone_database tzdb;
+  if(!tzdb.load_from_struct(data, from, to))
+    throw std::runtime_error("Error loading time zone database struct");
+  return tzdb;
+}
+
+//! Keeps a time zone database in step with its source on disk: a database file or the zone files of a zoneinfo directory.
+//! A background thread watches the source with inotify and, once the changes have settled, parses them, checks the
+//! zones and publishes the result as a new immutable snapshot. Readers only ever swap a pointer, so they never wait on
+//! the parse or on I/O; callbacks and futures report each refresh. A failed refresh keeps the previous snapshot.
+class time_zone_database_watcher {
+public:
+  typedef std::shared_ptr<const time_zone_database>                     snapshot_ptr;
+  //! Called on the watcher thread after each refresh with the snapshot in effect and the error of a failed refresh; must not throw
+  typedef std::function<void(const snapshot_ptr&, std::exception_ptr)>  callback_type;
+
+  enum source_kind {
+    CSV_FILE,             //!< file written by save_to_file with CSV_FORMAT
+    BINARY_FILE,          //!< file written by save_to_file with BINARY_FORMAT
+    #ifdef USE_ZONEINFO
+    ZONEINFO_DIRECTORY    //!< zone files, one region each
+    #endif
+  };
+
+  //! Load the source, throwing if that fails, and start watching it. For a zoneinfo directory zones lists the regions
+  //! to keep; when empty every zone file is kept, including new ones, except those of the posix/ and right/ copies.
+  time_zone_database_watcher(source_kind kind, const std::string& path, const std::vector<std::string>& zones = std::vector<std::string>(), unsigned settle_milliseconds = 200)
+    : _kind(kind), _path(path), _zones(zones.begin(), zones.end()), _all_zones(zones.empty()), _settle(settle_milliseconds),
+      _inotify(-1), _wake(-1), _generation(1), _stop(false), _full_refresh(false), _next(std::make_shared<std::promise<snapshot_ptr> >()), _future(_next->get_future()) {
+    if(kind == CSV_FILE || kind == BINARY_FILE) {
+      boost::filesystem::path p(path);
+      _directory = p.has_parent_path() ? p.parent_path().string() : ".";
+      _filename = p.filename().string();
+    }
+    _snapshot = load_all();
+    _inotify = ::inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    _wake = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(_inotify < 0 || _wake < 0) {
+      close_descriptors();
+      throw std::runtime_error("Error starting the time zone watcher");
+    }
+    // the destructor does not run if the constructor throws, std::thread included
+    try {
+      std::set<std::string> ignored;
+      if(!watch(kind == CSV_FILE || kind == BINARY_FILE ? _directory : std::string(), ignored))
+        throw std::runtime_error("Error watching '" + _path + "'");
+      _thread = std::thread(&time_zone_database_watcher::run, this);
+    }
+    catch(...) {
+      close_descriptors();
+      throw;
+    }
+  }
+
+  time_zone_database_watcher(const time_zone_database_watcher&) = delete;
+  time_zone_database_watcher& operator=(const time_zone_database_watcher&) = delete;
+
+  ~time_zone_database_watcher() {
+    _stop = true;
+    wake();
+    _thread.join();
+    close_descriptors();
+  }
+
+  //! Current snapshot, valid for as long as it is held
+  snapshot_ptr snapshot() const { return std::atomic_load(&_snapshot); }
+
+  //! Snapshots published so far, 1 for the one loaded by the constructor
+  uint64_t generation() const { return _generation.load(std::memory_order_acquire); }
+
+  void on_refresh(const callback_type& callback) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _callbacks.push_back(callback);
+  }
+
+  //! Completes with the snapshot published by the next refresh to start, or with its error
+  std::shared_future<snapshot_ptr> next_snapshot() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _future;
+  }
+
+  //! Reload the whole source now instead of waiting for changes, without blocking; completes like next_snapshot
+  std::shared_future<snapshot_ptr> refresh() {
+    std::shared_future<snapshot_ptr> f;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _full_refresh = true;
+      f = _future;
+    }
+    wake();
+    return f;
+  }
+
+private:
+  source_kind                                       _kind;
+  std::string                                       _path;
+  std::string                                       _directory;   //!< directory watched for a database file
+  std::string                                       _filename;    //!< name of the database file in it
+  std::set<std::string>                             _zones;       //!< regions kept from a zoneinfo directory
+  bool                                              _all_zones;
+  unsigned                                          _settle;      //!< quiet time before changes are parsed, in milliseconds
+  int                                               _inotify;
+  int                                               _wake;
+  std::map<int, std::string>                        _watches;     //!< watched directories by watch descriptor, relative to _path for zoneinfo
+  snapshot_ptr                                      _snapshot;
+  std::atomic<uint64_t>                             _generation;
+  std::atomic<bool>                                 _stop;
+  mutable std::mutex                                _mutex;       //!< guards the fields below
+  bool                                              _full_refresh;
+  std::shared_ptr<std::promise<snapshot_ptr> >      _next;
+  std::shared_future<snapshot_ptr>                  _future;
+  std::vector<callback_type>                        _callbacks;
+  std::thread                                       _thread;
+
+  void close_descriptors() {
+    if(_inotify >= 0)
+      ::close(_inotify);
+    if(_wake >= 0)
+      ::close(_wake);
+    _inotify = _wake = -1;
+  }
+
+  void wake() {
+    uint64_t one = 1;
+    if(::write(_wake, &one, sizeof(one)) < 0) { } // a pending wake up is enough
+  }
+
+  static bool is_zone_file(const boost::filesystem::path& p) {
+    std::ifstream f(p.string(), std::ios::binary);
+    char magic[4];
+    return f.read(magic, 4) && std::string(magic, 4) == "TZif";
+  }
+
+  //! Watch a directory, relative to _path for zoneinfo, and its subdirectories, adding the zone files found in them to changed
+  bool watch(const std::string& relative, std::set<std::string>& changed) {
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR;
+    bool zoneinfo = _kind != CSV_FILE && _kind != BINARY_FILE;
+    boost::filesystem::path dir = zoneinfo ? boost::filesystem::path(_path) / relative : boost::filesystem::path(relative);
+    int wd = ::inotify_add_watch(_inotify, dir.string().c_str(), mask);
+    if(wd < 0)
+      return false;
+    _watches[wd] = relative;
+    if(!zoneinfo)
+      return true;
+    boost::system::error_code ec;
+    for(boost::filesystem::directory_iterator it(dir, ec), end; !ec && it!=end; it.increment(ec)) {
+      std::string name = relative.empty() ? it->path().filename().string() : relative + "/" + it->path().filename().string();
+      if(boost::filesystem::is_directory(it->status()))
+        watch(name, changed);
+      else
+        changed.insert(name);
+    }
+    return true;
+  }
+
+  //! Whether a zoneinfo file name is one of the regions kept
+  bool tracked(const std::string& name) const {
+    if(!_all_zones)
+      return _zones.count(name) != 0;
+    return name.compare(0, 6, "posix/") && name.compare(0, 6, "right/") && name.find('.') == std::string::npos;
+  }
+
+  snapshot_ptr load_all() {
+    std::shared_ptr<time_zone_database> db = std::make_shared<time_zone_database>();
+    #ifdef USE_ZONEINFO
+    if(_kind == ZONEINFO_DIRECTORY) {
+      std::set<std::string> names(_zones);
+      if(_all_zones) {
+        for(boost::filesystem::recursive_directory_iterator it(_path), end; it!=end; ++it) {
+          std::string name = it->path().filename().string();
+          if(boost::filesystem::is_directory(it->status()) && (name == "posix" || name == "right"))
+            #if BOOST_VERSION >= 107200
+            it.disable_recursion_pending();
+            #else
+            it.no_push();
+            #endif
+          else if(boost::filesystem::is_regular_file(it->status()) && is_zone_file(it->path()))
+            names.insert(it->path().lexically_relative(_path).generic_string());
+        }
+      }
+      for(auto it=names.begin(); it!=names.end(); ++it)
+        db->add_record(*it, load_zone(*it));
+    }
+    else
+    #endif
+    if(_kind == BINARY_FILE ? !db->load_from_binary(_path) : !db->load_from_file(_path))
+      throw std::runtime_error("Error loading time zone database file '" + _path + "'");
+    if(db->region_list().empty())
+      throw std::runtime_error("No time zones loaded from '" + _path + "'");
+    return db;
+  }
+
+  #ifdef USE_ZONEINFO
+  time_zone_ptr load_zone(const std::string& name) const {
+    time_zone_ptr tz = std::make_shared<time_zone>(time_zone::from_zoneinfo(name, _path));
+    if(tz->kind() == time_zone::EMPTY_ZONE)
+      throw std::runtime_error("Zone file '" + name + "' has no entries");
+    return tz;
+  }
+
+  //! The current snapshot with the zone files in changed reloaded, or removed when they no longer exist
+  snapshot_ptr load_changes(const std::set<std::string>& changed) {
+    std::shared_ptr<time_zone_database> db = std::make_shared<time_zone_database>(*snapshot());
+    for(auto it=changed.begin(); it!=changed.end(); ++it) {
+      boost::filesystem::path p = boost::filesystem::path(_path) / *it;
+      if(boost::filesystem::is_regular_file(p) && is_zone_file(p))
+        db->add_record(*it, load_zone(*it));
+      else if(!boost::filesystem::exists(p))
+        db->delete_record(*it);
+    }
+    return db;
+  }
+  #endif
+
+  //! Read the pending inotify events, adding the changed zone files to changed; true if a database file changed
+  bool read_events(std::set<std::string>& changed) {
+    bool file_changed = false;
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t n;
+    while((n = ::read(_inotify, buf, sizeof(buf))) > 0) {
+      for(char* p = buf; p < buf + n; p += sizeof(struct inotify_event) + reinterpret_cast<struct inotify_event*>(p)->len) {
+        const struct inotify_event* e = reinterpret_cast<const struct inotify_event*>(p);
+        if(e->mask & IN_IGNORED) {
+          _watches.erase(e->wd);
+          continue;
+        }
+        auto w = _watches.find(e->wd);
+        if(w == _watches.end() || !e->len)
+          continue;
+        std::string name(e->name);
+        if(_kind == CSV_FILE || _kind == BINARY_FILE) {
+          file_changed |= name == _filename;
+          continue;
+        }
+        if(!w->second.empty())
+          name = w->second + "/" + name;
+        if((e->mask & IN_ISDIR) && (e->mask & (IN_CREATE | IN_MOVED_TO)))
+          watch(name, changed);
+        else if(!(e->mask & IN_ISDIR))
+          changed.insert(name);
+      }
+    }
+    return file_changed;
+  }
+
+  void run() {
+    std::set<std::string> changed;
+    bool file_changed = false;
+    while(!_stop) {
+      // wait for events, then for the source to stay quiet for the settle time
+      bool pending = file_changed || !changed.empty();
+      struct pollfd fds[2] = { { _inotify, POLLIN, 0 }, { _wake, POLLIN, 0 } };
+      int ready = ::poll(fds, 2, pending ? static_cast<int>(_settle) : -1);
+      if(ready < 0 && errno != EINTR)
+        break; // LCOV_EXCL_LINE
+      if(fds[1].revents & POLLIN) {
+        uint64_t count;
+        if(::read(_wake, &count, sizeof(count)) < 0) { }
+      }
+      if(fds[0].revents & POLLIN)
+        file_changed |= read_events(changed);
+
+      bool full = false;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        full = _full_refresh;
+      }
+      if(_stop || (!full && (ready != 0 || !pending)))
+        continue;
+
+      std::set<std::string> zones;
+      for(auto it=changed.begin(); it!=changed.end(); ++it)
+        if(tracked(*it))
+          zones.insert(*it);
+      bool reload = full || file_changed || !zones.empty();
+      changed.clear();
+      file_changed = false;
+      if(!reload)
+        continue;
+      refresh(full, zones);
+    }
+  }
+
+  //! Publish a new snapshot, calling the callbacks and then completing the futures handed out so far
+  void refresh(bool full, const std::set<std::string>& zones) {
+    std::shared_ptr<std::promise<snapshot_ptr> > done;
+    std::vector<callback_type> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _full_refresh = false;
+      done = _next;
+      _next = std::make_shared<std::promise<snapshot_ptr> >();
+      _future = _next->get_future();
+      callbacks = _callbacks;
+    }
+    snapshot_ptr next;
+    std::exception_ptr error;
+    try {
+      #ifdef USE_ZONEINFO
+      if(_kind == ZONEINFO_DIRECTORY && !full)
+        next = load_changes(zones);
+      else
+      #endif
+      next = load_all();
+      std::atomic_store(&_snapshot, next);
+      _generation.fetch_add(1, std::memory_order_release);
+    }
+    catch(...) {
+      error = std::current_exception();
+      next = snapshot();
+    }
+    for(auto it=callbacks.begin(); it!=callbacks.end(); ++it)
+      (*it)(next, error);
+    if(error)
+      done->set_exception(error);
+    else
+      done->set_value(next);
+  }
+};
+
+}
+#endif
@@ -0,0 +1,179 @@
+// Benchmark of the conversion paths over a set of zones, also the training run of
+// profile guided builds (see the LOCAL_TIME_PGO option of CMakeLists.txt). Times are
+// drawn from [2000-01-01, 2030-01-01), either sorted like a column of ticks or in
+// random order like lookups of unrelated events, and each workload is run over every zone.
+//
+//   tzbench [samples per zone] [zoneinfo directory] [zone ...]
+
+#include "../local_date_time.hpp"
+#include "../timezone_loaders.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+using namespace local_time;
+
+namespace {
+
+const int64_t first_microsecond = INT64_C(946684800000000);
+const int64_t last_microsecond = INT64_C(1893456000000000);
+
+const char* const default_zones[] = {
+  "America/New_York", "America/Chicago", "America/Los_Angeles", "America/Sao_Paulo", "Europe/London",
+  "Europe/Berlin", "Europe/Moscow", "Asia/Kolkata", "Asia/Shanghai", "Asia/Tokyo", "Australia/Sydney", "UTC"
+};
+
+struct workload {
+  workload(const char* n) : name(n), conversions(0), ns(0) { }
+  const char* name;
+  std::size_t conversions;
+  int64_t     ns;
+};
+
+//! Local time of a UTC time, moved past the repeated hour if it falls in one so that converting it back cannot throw
+int64_t unambiguous_local(const time_zone& tz, int64_t utc) {
+  while(true) {
+    int64_t local = tz.to_local(utc);
+    try {
+      tz.to_utc(local);
+      return local;
+    }
+    catch(const ambiguous_result&) {
+      utc += INT64_C(3600000000);
+    }
+  }
+}
+
+//! Run f over each zone index, zone and the zone following it, adding its conversions and time to w
+template<class F>
+void run(workload& w, const std::vector<time_zone_const_ptr>& zones, std::size_t count, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for(std::size_t z=0; z<zones.size(); ++z)
+    f(z, *zones[z], *zones[(z + 1) % zones.size()]);
+  w.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  w.conversions += count * zones.size();
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::size_t samples = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+  std::string dir = argc > 2 ? argv[2] : TZDIR;
+  std::vector<std::string> names(argv + std::min(argc, 3), argv + argc);
+  if(!samples) {
+    std::cerr << "usage: " << argv[0] << " [samples per zone] [zoneinfo directory] [zone ...]" << std::endl;
+    return 1;
+  }
+  if(names.empty())
+    names.assign(default_zones, default_zones + sizeof(default_zones) / sizeof(default_zones[0]));
+
+  std::vector<time_zone_const_ptr> zones;
+  try {
+    for(auto it=names.begin(); it!=names.end(); ++it)
+      zones.push_back(std::make_shared<time_zone>(time_zone::from_zoneinfo(*it, dir)));
+  }
+  catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::mt19937_64 random(20150321);
+  std::uniform_int_distribution<int64_t> microseconds(first_microsecond, last_microsecond - 1);
+  std::vector<int64_t> random_times(samples), sorted_times(samples), out(samples);
+  std::vector<int32_t> days(samples);
+  for(std::size_t i=0; i<samples; ++i)
+    random_times[i] = microseconds(random);
+  sorted_times = random_times;
+  std::sort(sorted_times.begin(), sorted_times.end());
+  std::vector<ptime> ptimes;
+  ptimes.reserve(samples);
+  for(auto it=random_times.begin(); it!=random_times.end(); ++it)
+    ptimes.push_back(ptime(boost::gregorian::date(1970,1,1)) + boost::posix_time::microseconds(*it));
+  // local times of each zone, for the local to UTC workloads
+  std::vector<std::vector<int64_t> > random_locals(zones.size()), sorted_locals(zones.size());
+  for(std::size_t z=0; z<zones.size(); ++z) {
+    for(std::size_t i=0; i<samples; ++i) {
+      random_locals[z].push_back(unambiguous_local(*zones[z], random_times[i]));
+      sorted_locals[z].push_back(unambiguous_local(*zones[z], sorted_times[i]));
+    }
+  }
+
+  // keeps the results alive so that the conversions are not optimized away
+  int64_t checksum = 0;
+  std::vector<workload> workloads;
+  workloads.push_back(workload("UTC to local, random"));
+  run(workloads.back(), zones, samples, [&](std::size_t, const time_zone& tz, const time_zone&) {
+    for(std::size_t i=0; i<samples; ++i)
+      checksum += tz.to_local(random_times[i]);
+  });
+  workloads.push_back(workload("UTC to local, sorted"));
+  run(workloads.back(), zones, samples, [&](std::size_t, const time_zone& tz, const time_zone&) {
+    for(std::size_t i=0; i<samples; ++i)
+      checksum += tz.to_local(sorted_times[i]);
+  });
+  workloads.push_back(workload("UTC to local, nanoseconds"));
+  run(workloads.back(), zones, samples, [&](std::size_t, const time_zone& tz, const time_zone&) {
+    for(std::size_t i=0; i<samples; ++i)
+      checksum += tz.to_local<nanosecond_resolution>(random_times[i] * 1000);
+  });
+  workloads.push_back(workload("local to UTC, random"));
+  run(workloads.back(), zones, samples, [&](std::size_t z, const time_zone& tz, const time_zone&) {
+    for(std::size_t i=0; i<samples; ++i)
+      checksum += tz.to_utc(random_locals[z][i], time_zone::THROW_ON_AMBIGUOUS);
+  });
+  // the local times of all zones interleaved, as messages from many sources arrive
+  workloads.push_back(workload("normalize, mixed zones"));
+  {
+    time_zone_normalizer normalizer(zones);
+    std::vector<zoned_time> batch;
+    batch.reserve(samples * zones.size());
+    for(std::size_t i=0; i<samples; ++i)
+      for(std::size_t z=0; z<zones.size(); ++z)
+        batch.push_back(zoned_time{static_cast<uint32_t>(z), random_locals[z][i]});
+    std::vector<int64_t> utc(batch.size());
+    auto start = std::chrono::steady_clock::now();
+    normalizer.to_utc(batch.data(), batch.size(), utc.data());
+    workloads.back().ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    workloads.back().conversions += batch.size();
+    checksum += utc[batch.size() / 2];
+  }
+  workloads.push_back(workload("rezone, sorted"));
+  run(workloads.back(), zones, samples, [&](std::size_t z, const time_zone& tz, const time_zone& to) {
+    time_zone::rezone(tz, to, sorted_locals[z].data(), samples, out.data(), time_zone::THROW_ON_AMBIGUOUS);
+    checksum += out[samples / 2];
+  });
+  workloads.push_back(workload("local days, sorted"));
+  run(workloads.back(), zones, samples, [&](std::size_t, const time_zone& tz, const time_zone&) {
+    tz.local_days(sorted_times.data(), samples, days.data(), out.data());
+    checksum += days[samples / 2] + out[samples / 2];
+  });
+  workloads.push_back(workload("ISO strings, random"));
+  run(workloads.back(), zones, samples, [&](std::size_t, const time_zone& tz, const time_zone&) {
+    char buf[time_zone::max_iso_string_size];
+    for(std::size_t i=0; i<samples; ++i)
+      checksum += tz.utc_to_local_iso_string(ptimes[i], buf) - buf;
+  });
+  workloads.push_back(workload("local_date_time, random"));
+  run(workloads.back(), zones, samples, [&](std::size_t z, const time_zone&, const time_zone&) {
+    for(std::size_t i=0; i<samples; ++i)
+      checksum += local_date_time(ptimes[i], zones[z]).local_time().time_of_day().total_seconds();
+  });
+
+  // memory of the zones and of their compacted copies, also builds the database members without LOCAL_TIME_STATISTICS
+  time_zone_database db;
+  for(std::size_t z=0; z<zones.size(); ++z)
+    db.add_record(names[z], std::const_pointer_cast<time_zone>(zones[z]));
+  std::size_t loaded_bytes = db.memory_usage();
+  db.compact();
+
+  std::cout << zones.size() << " zones, " << samples << " times per zone and workload" << std::endl;
+  std::cout << "  " << loaded_bytes << " bytes of zones after the workloads, " << db.memory_usage() << " compacted" << std::endl;
+  for(auto it=workloads.begin(); it!=workloads.end(); ++it)
+    std::cout << "  " << std::left << std::setw(28) << it->name << std::right << std::setw(10) << std::fixed << std::setprecision(2)
+              << (it->conversions ? static_cast<double>(it->ns) / it->conversions : 0.) << " ns per conversion" << std::endl;
+  std::cout << "checksum " << checksum << std::endl;
+  return 0;
+}
@@ -0,0 +1,32 @@
+// Computes the update turning a time zone database file into another one, to be
+// applied with time_zone_database::apply_update.
+//
+//   tzdiff <old database> <new database> <update file>
+
+#include "../timezone_loaders.hpp"
+#include <iostream>
+
+using namespace local_time;
+
+int main(int argc, char** argv) {
+  if(argc != 4) {
+    std::cerr << "usage: " << argv[0] << " <old database> <new database> <update file>" << std::endl;
+    return 1;
+  }
+  try {
+    time_zone_update update = time_zone_database::diff(time_zone_database::from_file(argv[1]), time_zone_database::from_file(argv[2]));
+    if(!update.save_to_file(argv[3])) {
+      std::cerr << "Error writing '" << argv[3] << "'" << std::endl;
+      return 1;
+    }
+    std::size_t entries = 0;
+    for(auto it=update.changes.begin(); it!=update.changes.end(); ++it)
+      entries += it->entries.size();
+    std::cout << update.changes.size() << " zones changed, " << entries << " transitions written" << std::endl;
+  }
+  catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,214 @@
+// Differential test and benchmark of the time zone lookups against the C library.
+// Every zone of a zoneinfo directory is loaded with time_zone::from_zoneinfo, then
+// random UTC and local times are converted both by local_date_time and by
+// localtime_r/mktime under TZ=, and the results are compared. Times are drawn from
+// [1901-12-14, 2037-01-01), the range covered by the transitions of the zone files;
+// later times depend on the POSIX TZ rules of the files, which are not loaded.
+//
+//   tzfuzz [samples per zone] [zoneinfo directory] [zone ...]
+
+#include "../local_date_time.hpp"
+#include "../timezone_loaders.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <random>
+
+using namespace local_time;
+
+namespace {
+
+const ptime epoch(boost::gregorian::date(1970,1,1));
+const int64_t first_second = INT64_C(-2147483648);
+const int64_t last_second = INT64_C(2114380800);
+const std::size_t max_reported = 10;
+
+struct totals {
+  totals() : zones(0), samples(0), mismatches(0), library_ns(0), libc_ns(0) { }
+  std::size_t zones;
+  std::size_t samples;
+  std::size_t mismatches;
+  int64_t     library_ns;
+  int64_t     libc_ns;
+};
+
+int64_t elapsed_ns(const std::chrono::steady_clock::time_point& start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int64_t seconds_of(const ptime& p) {
+  return (p - epoch).total_seconds();
+}
+
+bool is_zone_file(const boost::filesystem::path& p) {
+  boost::filesystem::ifstream f(p, std::ios::binary);
+  char magic[4];
+  return f.read(magic, 4) && std::string(magic, 4) == "TZif";
+}
+
+void report(std::size_t& reported, const std::string& zone, const char* what, int64_t input, const std::string& ours, const std::string& theirs) {
+  if(reported++ < max_reported)
+    std::cout << zone << ": " << what << " " << boost::posix_time::to_iso_string(epoch + boost::posix_time::seconds(input))
+              << " gives " << ours << ", the C library gives " << theirs << std::endl;
+}
+
+//! UTC to local: local time and DST flag
+void compare_utc(const std::string& zone, time_zone_const_ptr tz, const std::vector<int64_t>& utc, totals& t, std::size_t& reported) {
+  std::vector<ptime> in;
+  in.reserve(utc.size());
+  for(auto it=utc.begin(); it!=utc.end(); ++it)
+    in.push_back(epoch + boost::posix_time::seconds(*it));
+
+  std::vector<int64_t> ours(utc.size());
+  std::vector<bool> ours_dst(utc.size());
+  auto start = std::chrono::steady_clock::now();
+  for(std::size_t i=0; i<in.size(); ++i) {
+    local_date_time ldt(in[i], tz);
+    ours[i] = seconds_of(ldt.local_time());
+    ours_dst[i] = ldt.is_dst();
+  }
+  t.library_ns += elapsed_ns(start);
+
+  std::vector<struct tm> theirs(utc.size());
+  start = std::chrono::steady_clock::now();
+  for(std::size_t i=0; i<utc.size(); ++i) {
+    time_t s = utc[i];
+    localtime_r(&s, &theirs[i]);
+  }
+  t.libc_ns += elapsed_ns(start);
+
+  for(std::size_t i=0; i<utc.size(); ++i) {
+    int64_t local = utc[i] + theirs[i].tm_gmtoff;
+    if(local != ours[i] || (theirs[i].tm_isdst > 0) != ours_dst[i]) {
+      ++t.mismatches;
+      report(reported, zone, "UTC", utc[i],
+             boost::posix_time::to_iso_string(epoch + boost::posix_time::seconds(ours[i])) + (ours_dst[i] ? " DST" : ""),
+             boost::posix_time::to_iso_string(epoch + boost::posix_time::seconds(local)) + (theirs[i].tm_isdst > 0 ? " DST" : ""));
+    }
+  }
+}
+
+//! Local to UTC: valid times must agree, ambiguous ones may resolve to either instant and invalid ones must not exist for the C library either
+void compare_local(const std::string& zone, time_zone_const_ptr tz, const std::vector<int64_t>& local, totals& t, std::size_t& reported) {
+  std::vector<ptime> in;
+  std::vector<struct tm> fields(local.size());
+  in.reserve(local.size());
+  for(std::size_t i=0; i<local.size(); ++i) {
+    in.push_back(epoch + boost::posix_time::seconds(local[i]));
+    time_t s = local[i];
+    gmtime_r(&s, &fields[i]);
+    fields[i].tm_isdst = -1;
+  }
+
+  std::vector<local_date_time_result> ours;
+  ours.reserve(local.size());
+  auto start = std::chrono::steady_clock::now();
+  for(std::size_t i=0; i<in.size(); ++i)
+    ours.push_back(local_date_time::try_from_local(in[i], tz));
+  t.library_ns += elapsed_ns(start);
+
+  std::vector<int64_t> theirs(local.size());
+  start = std::chrono::steady_clock::now();
+  for(std::size_t i=0; i<local.size(); ++i)
+    theirs[i] = mktime(&fields[i]);
+  t.libc_ns += elapsed_ns(start);
+
+  for(std::size_t i=0; i<local.size(); ++i) {
+    bool same = false;
+    std::string result;
+    switch(ours[i].status()) {
+      case LOCAL_TIME_VALID:
+        same = theirs[i] == seconds_of(ours[i].value().utc_time());
+        result = boost::posix_time::to_iso_string(ours[i].value().utc_time()) + " UTC";
+        break;
+      case LOCAL_TIME_AMBIGUOUS:
+        same = theirs[i] == seconds_of(ours[i].earlier().utc_time()) || theirs[i] == seconds_of(ours[i].later().utc_time());
+        result = "ambiguous";
+        break;
+      case LOCAL_TIME_INVALID: {
+        struct tm back;
+        time_t s = theirs[i];
+        localtime_r(&s, &back);
+        same = theirs[i] + back.tm_gmtoff != local[i];
+        result = "invalid";
+        break;
+      }
+    }
+    if(!same) {
+      ++t.mismatches;
+      report(reported, zone, "local", local[i], result, boost::posix_time::to_iso_string(epoch + boost::posix_time::seconds(theirs[i])) + " UTC");
+    }
+  }
+}
+
+void print_rate(const char* name, std::size_t samples, int64_t ns) {
+  std::cout << "  " << name << ": " << (samples ? static_cast<double>(ns) / samples : 0.) << " ns per conversion, "
+            << (ns ? samples * 1e3 / ns : 0.) << " million conversions per second" << std::endl;
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::size_t samples = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+  std::string dir = argc > 2 ? argv[2] : TZDIR;
+  std::vector<std::string> zones(argv + std::min(argc, 3), argv + argc);
+  if(!samples) {
+    std::cerr << "usage: " << argv[0] << " [samples per zone] [zoneinfo directory] [zone ...]" << std::endl;
+    return 1;
+  }
+  if(zones.empty()) {
+    // every zone file, leaving out the leap second and POSIX copies of the zones
+    try {
+      for(boost::filesystem::recursive_directory_iterator it(dir), end; it!=end; ++it) {
+        std::string name = it->path().filename().string();
+        if(boost::filesystem::is_directory(it->status()) && (name == "posix" || name == "right"))
+          it.no_push();
+        else if(boost::filesystem::is_regular_file(it->status()) && is_zone_file(it->path()))
+          zones.push_back(it->path().string().substr(dir.size() + 1));
+      }
+    }
+    catch(const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    std::sort(zones.begin(), zones.end());
+  }
+
+  std::mt19937_64 random(20150321);
+  std::uniform_int_distribution<int64_t> seconds(first_second, last_second - 1);
+  std::vector<int64_t> utc(samples), local(samples);
+  totals utc_totals, local_totals;
+  for(auto it=zones.begin(); it!=zones.end(); ++it) {
+    time_zone_const_ptr tz;
+    try {
+      tz = std::make_shared<time_zone>(time_zone::from_zoneinfo(*it, dir));
+    }
+    catch(const std::exception& e) {
+      std::cout << *it << ": " << e.what() << std::endl;
+      ++utc_totals.mismatches;
+      continue;
+    }
+    setenv("TZ", (":" + dir + "/" + *it).c_str(), 1);
+    tzset();
+    for(std::size_t i=0; i<samples; ++i) {
+      utc[i] = seconds(random);
+      local[i] = seconds(random);
+    }
+    std::size_t reported = 0;
+    compare_utc(*it, tz, utc, utc_totals, reported);
+    compare_local(*it, tz, local, local_totals, reported);
+    utc_totals.samples += samples;
+    local_totals.samples += samples;
+    ++utc_totals.zones;
+  }
+
+  std::cout << utc_totals.zones << " zones, " << utc_totals.samples << " UTC and " << local_totals.samples << " local times" << std::endl;
+  std::cout << "UTC to local, " << utc_totals.mismatches << " mismatches" << std::endl;
+  print_rate("local_date_time", utc_totals.samples, utc_totals.library_ns);
+  print_rate("localtime_r", utc_totals.samples, utc_totals.libc_ns);
+  std::cout << "local to UTC, " << local_totals.mismatches << " mismatches" << std::endl;
+  print_rate("local_date_time", local_totals.samples, local_totals.library_ns);
+  print_rate("mktime", local_totals.samples, local_totals.libc_ns);
+  return utc_totals.mismatches + local_totals.mismatches ? 1 : 0;
+}